@@ -0,0 +1,108 @@
+// Validates the no-time-counter collision scheme of optical_molasses against
+// testing every candidate pair. Runs collisions alone on a thermal ensemble
+// (they conserve its energy) with a floor on the relative speed, once only
+// testing pairs up to the majorant and once testing all of them, and
+// compares the numbers of collisions and the runtimes. Also reports how far
+// the floor moves the number of collisions from that without one.
+#include <cmath>
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "lasercool/fundconst.hpp"
+#include "lasercool/threadpool.hpp"
+#include "PhysicalParams.hpp"
+#include "ParticleEnsemble.hpp"
+#include "RandProcesses.hpp"
+#include "CollisionEngine.hpp"
+#include "pcg_random.hpp"
+
+// Largest allowed difference in the numbers of collisions, in standard errors
+const double MAX_Z_SCORE = 4;
+const unsigned N_STEPS = 4000;
+
+struct CollisionRun {
+    unsigned long collisions;
+    double runtime;
+    double majorant;
+};
+
+CollisionRun run_collisions(const PhysicalParams& params, bool test_all_pairs,
+    unsigned long seed) {
+    double thermal_v_stddev = sqrt(
+        fundamental_constants::K_BOLTZMANN*params.initial_temp/params.mass);
+    pcg32 generator(seed);
+    std::vector< RandProcesses<pcg32> > rngs(1,
+        RandProcesses<pcg32>(generator, thermal_v_stddev, params.n_particles));
+    ParticleEnsemble particles(params.n_particles);
+    double sum_v_sqr = 0;
+    for(unsigned c = 0; c < 3; ++c) {
+        rngs[0].fill_thermal_velocity(particles.component(c),
+            params.n_particles);
+    }
+    for(unsigned p = 0; p < params.n_particles; ++p) {
+        sum_v_sqr += particles.speed_sqr(p);
+    }
+    double avgKE = 0.5*params.mass*sum_v_sqr/params.n_particles;
+
+    ThreadPool pool(1);
+    CollisionEngine engine(params.n_particles, test_all_pairs);
+    CollisionRun run{0, 0, 0};
+    auto start = std::chrono::steady_clock::now();
+    for(unsigned s = 0; s < N_STEPS; ++s) {
+        run.collisions += engine.step(particles, params, avgKE, pool, rngs);
+    }
+    run.runtime = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    run.majorant = engine.majorant();
+    return run;
+}
+
+int main() {
+    std::unordered_map<std::string, double> config = {
+        {"rabi_frequency", 1},
+        {"initial_detuning", -0.5},
+        {"final_detuning", -0.5},
+        {"detuning_ramp_rate", 0},
+        {"initial_temperature", 0.01},
+        {"time_step", 0.05},
+        {"duration", 1000},
+        {"n_particles", 4000},
+        {"particle_density", 1e10},
+        {"threads", 1}
+    };
+    bool passed = true;
+    std::cout << std::setprecision(4);
+
+    CollisionRun exact = run_collisions(PhysicalParams("Rb", config), true, 1);
+    std::cout << "No floor: " << exact.collisions << " collisions, runtime "
+        << exact.runtime << " s" << std::endl;
+
+    for(double floor: {0.03, 0.1}) {
+        config["collision_speed_floor"] = floor;
+        PhysicalParams params("Rb", config);
+        CollisionRun all = run_collisions(params, true, 2);
+        CollisionRun ntc = run_collisions(params, false, 3);
+        // The counts are sums of independent Bernoulli trials, so their
+        // variances are at most their means
+        double z = (static_cast<double>(ntc.collisions) - all.collisions)
+            / sqrt(static_cast<double>(ntc.collisions + all.collisions));
+        std::cout << "Floor " << floor << " x RMS relative speed (majorant "
+            << ntc.majorant << "):" << std::endl
+            << "    All pairs: " << all.collisions << " collisions, runtime "
+            << all.runtime << " s" << std::endl
+            << "    Majorant: " << ntc.collisions << " collisions, runtime "
+            << ntc.runtime << " s" << std::endl
+            << "    Difference: " << z << " standard errors" << std::endl
+            << "    Speedup: " << all.runtime/ntc.runtime << "x" << std::endl
+            << "    Change from no floor: "
+            << 100*(static_cast<double>(all.collisions)/exact.collisions - 1)
+            << "%" << std::endl;
+        passed = passed && std::abs(z) < MAX_Z_SCORE;
+    }
+
+    std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+    return passed ? 0 : 1;
+}
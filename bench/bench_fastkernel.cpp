@@ -0,0 +1,120 @@
+// Validates the fast photon absorption/emission kernels of optical_molasses
+// against the exact ones. First compares the rearranged absorption rate
+// calculations directly over a grid of detunings, then runs small fixed-seed
+// simulations with both kernels and both absorption engines and compares
+// their final temperatures and runtimes.
+#include <cmath>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "lasercool/fundconst.hpp"
+#include "PhysicalParams.hpp"
+#include "MolassesSimulation.hpp"
+
+// Largest allowed relative error of the rearranged rate calculations
+const double MAX_REL_ERROR = 1e-6;
+// Largest allowed difference in mean final temperatures, in standard errors
+const double MAX_Z_SCORE = 4;
+const unsigned N_SEEDS = 8;
+
+// Largest relative error of the fast kernels' absorption rate calculations
+// over a grid of Doppler-shifted detunings
+double rate_error(const PhysicalParams& params) {
+    const AbsorbRateCoeffs coeffs(params.decay_rate, params.rabi_freq);
+    double max_err = 0;
+    // Detunings from far off resonance on one side to the other
+    for(double x = -1e4; x <= 1e4; x += 0.37) {
+        double detuning = x*params.decay_rate;
+        // Single laser
+        double exact = PhysicalParams::calc_absorb_rate(params.decay_rate,
+            params.rabi_freq, detuning);
+        double fast = coeffs.numer/(sqr(detuning) + coeffs.offset);
+        max_err = std::max(max_err, std::abs(fast - exact)/exact);
+
+        // Total over 6 lasers, as in the event-driven kernel, with the
+        // Doppler shifts spread out around the detuning
+        double D[PhysicalParams::n_lasers], total_exact = 0;
+        for(unsigned j = 0; j < PhysicalParams::n_lasers; ++j) {
+            double shifted = detuning*(1 + 0.5*j) - j*params.decay_rate;
+            D[j] = sqr(shifted) + coeffs.offset;
+            total_exact += PhysicalParams::calc_absorb_rate(params.decay_rate,
+                params.rabi_freq, shifted);
+        }
+        double prefix = 1, sum_of_products = 0;
+        for(unsigned j = 0; j < PhysicalParams::n_lasers; ++j) {
+            double others = prefix;
+            for(unsigned i = j + 1; i < PhysicalParams::n_lasers; ++i) {
+                others *= D[i];
+            }
+            sum_of_products += others;
+            prefix *= D[j];
+        }
+        double total_fast = coeffs.numer*sum_of_products/prefix;
+        max_err = std::max(max_err,
+            std::abs(total_fast - total_exact)/total_exact);
+    }
+    return max_err;
+}
+
+int main() {
+    std::unordered_map<std::string, double> config = {
+        {"rabi_frequency", 1},
+        {"initial_detuning", -0.5},
+        {"final_detuning", -0.5},
+        {"detuning_ramp_rate", 0},
+        {"initial_temperature", 0.01},
+        {"time_step", 0.05},
+        {"duration", 1000},
+        {"n_particles", 1000},
+        {"particle_density", 0},
+        {"threads", 1},
+        {"snapshots", 11}
+    };
+    bool passed = true;
+
+    double err = rate_error(PhysicalParams("Rb", config));
+    std::cout << "Absorption rate max relative error: " << err << std::endl;
+    passed = passed && err < MAX_REL_ERROR;
+
+    std::cout << std::setprecision(4);
+    for(double engine: {0, 1}) {
+        config["absorption_engine"] = engine;
+        std::cout << (engine ? "Event-driven" : "Fixed step")
+            << " engine:" << std::endl;
+        // Mean and variance of the final temperature, and total runtime,
+        // for the exact and fast kernels
+        double mean[2], var[2], runtime[2];
+        for(unsigned fast = 0; fast < 2; ++fast) {
+            config["fast_kernel"] = fast;
+            std::vector<double> temps;
+            runtime[fast] = 0;
+            for(unsigned seed = 1; seed <= N_SEEDS; ++seed) {
+                config["seed"] = seed;
+                MolassesSimulation sim(PhysicalParams("Rb", config));
+                SimResults results = sim.run();
+                temps.push_back(results.final_temp);
+                runtime[fast] += results.runtime;
+            }
+            mean[fast] = var[fast] = 0;
+            for(double T: temps) {
+                mean[fast] += T / N_SEEDS;
+            }
+            for(double T: temps) {
+                var[fast] += sqr(T - mean[fast]) / (N_SEEDS - 1);
+            }
+            std::cout << "    " << (fast ? "Fast" : "Exact")
+                << " kernel final temperature: " << mean[fast]*1e6 << " +/- "
+                << sqrt(var[fast]/N_SEEDS)*1e6 << " uK, runtime "
+                << runtime[fast] << " s" << std::endl;
+        }
+        double z = (mean[1] - mean[0])/sqrt((var[0] + var[1])/N_SEEDS);
+        std::cout << "    Difference: " << z << " standard errors" << std::endl
+            << "    Speedup: " << runtime[0]/runtime[1] << "x" << std::endl;
+        passed = passed && std::abs(z) < MAX_Z_SCORE;
+    }
+
+    std::cout << (passed ? "PASSED" : "FAILED") << std::endl;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,407 @@
+// Throughput benchmarks of the simulation kernels, with fixed seeds and
+// fixed configurations so that runs are comparable between revisions:
+// - optical_molasses particle steps per second as the number of particles
+//   scales, for both absorption engines
+// - HMotion derivative evaluations per second as the momentum range scales,
+//   as the number of threads scales, as the coherence bandwidth scales, and
+//   in single precision, and whole Dormand-Prince steps per second as the
+//   number of threads scales
+// - Adaptive stepper throughput on the problems of test/test_timestepping
+// - Output table writer bandwidth, for text and .npy tables
+// Progress goes to stderr, and the results to stdout, or to the file given
+// as the only argument, as JSON.
+#include <cmath>
+#include <cstdio>
+#include <chrono>
+#include <complex>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "lasercool/fundconst.hpp"
+#include "lasercool/tableio.hpp"
+#include "lasercool/timestepping.hpp"
+#include "PhysicalParams.hpp"
+#include "MolassesSimulation.hpp"
+#include "HMotion.hpp"
+using namespace std::complex_literals;
+
+// Repeat the short benchmarks for at least this long, in seconds
+const double MIN_BENCH_SECONDS = 0.5;
+const std::string TABLE_TMPFILE = "bench_kernels_table.tmp";
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+}
+
+// Calls f() until MIN_BENCH_SECONDS have passed, returning the number of
+// calls per second
+double calls_per_second(const std::function<void()>& f) {
+    auto start = std::chrono::steady_clock::now();
+    unsigned long calls = 0;
+    double elapsed;
+    do {
+        f();
+        ++calls;
+        elapsed = seconds_since(start);
+    } while(elapsed < MIN_BENCH_SECONDS);
+    return calls / elapsed;
+}
+
+// Minimal JSON writer for a list of flat records per benchmark
+class JsonRecords {
+    private:
+        std::ostringstream json;
+        bool first_group = true, first_record = true;
+        bool first_field = true;
+    public:
+        JsonRecords() {json << std::setprecision(6) << "{";}
+
+        void begin_group(std::string name) {
+            json << (first_group ? "" : "],") << "\n  \"" << name << "\": [";
+            first_group = false;
+            first_record = true;
+        }
+        void begin_record() {
+            json << (first_record ? "" : ",") << "\n    {";
+            first_record = false;
+            first_field = true;
+        }
+        void end_record() {json << "}";}
+        void field(std::string key, double value) {
+            json << (first_field ? "" : ", ") << "\"" << key << "\": ";
+            if(std::isfinite(value)) {
+                json << value;
+            } else {
+                json << "null";
+            }
+            first_field = false;
+        }
+        void field(std::string key, unsigned long count) {
+            json << (first_field ? "" : ", ") << "\"" << key << "\": "
+                << count;
+            first_field = false;
+        }
+        void field(std::string key, std::string value) {
+            json << (first_field ? "" : ", ") << "\"" << key << "\": \""
+                << value << "\"";
+            first_field = false;
+        }
+        std::string str() const {
+            return json.str() + (first_group ? "" : "]") + "\n}\n";
+        }
+};
+
+void bench_optmol(JsonRecords& results) {
+    results.begin_group("optical_molasses");
+    std::unordered_map<std::string, double> config = {
+        {"rabi_frequency", 1},
+        {"initial_detuning", -0.5},
+        {"final_detuning", -0.5},
+        {"detuning_ramp_rate", 0},
+        {"initial_temperature", 0.01},
+        {"time_step", 0.05},
+        {"duration", 100},
+        {"particle_density", 0},
+        {"threads", 1},
+        {"snapshots", 11},
+        {"seed", 1}
+    };
+    for(double engine: {0, 1}) {
+        config["absorption_engine"] = engine;
+        for(double n_particles: {500, 2000, 8000}) {
+            config["n_particles"] = n_particles;
+            PhysicalParams params("Rb", config);
+            MolassesSimulation sim(params);
+            SimResults sim_results = sim.run();
+            double particle_steps =
+                n_particles*static_cast<double>(params.n_time_steps);
+            std::string engine_name = engine ? "event_driven" : "fixed_step";
+            std::cerr << "optical_molasses " << engine_name << " N = "
+                << n_particles << ": " << sim_results.runtime << " s"
+                << std::endl;
+
+            results.begin_record();
+            results.field("engine", engine_name);
+            results.field("n_particles", n_particles);
+            results.field("time_steps",
+                static_cast<unsigned long>(params.n_time_steps));
+            results.field("runtime_s", sim_results.runtime);
+            results.field("particle_steps_per_s",
+                particle_steps/sim_results.runtime);
+            results.end_record();
+        }
+    }
+}
+
+// Evenly populated lower state, with some coherence everywhere
+template<typename real=double>
+std::vector<std::complex<real>> hmotion_state(const HMotion& hamil) {
+    std::vector<std::complex<real>> rho_c(hamil.handler.size(),
+        std::complex<real>(1e-3, 1e-3));
+    for(int k = hamil.handler.kmin; k <= hamil.handler.kmax; ++k) {
+        hamil.handler.at(rho_c, 1, k, 1, k) =
+            real(1)/(hamil.handler.kmax - hamil.handler.kmin + 1);
+    }
+    return rho_c;
+}
+
+// Derivative evaluations per second, with the density matrix stored at the
+// given precision
+template<typename real=double>
+double hmotion_rate(HMotion& hamil) {
+    std::vector<std::complex<real>> rho_c = hmotion_state<real>(hamil),
+        drho_c;
+    // A new time on every call, as in a real solve
+    double gt = 0;
+    return calls_per_second([&]() {
+        hamil(gt, rho_c, drho_c);
+        gt += 1e-3;
+    });
+}
+
+void bench_hmotion(JsonRecords& results) {
+    results.begin_group("hmotion_derivative");
+    auto config = read_config("../config/params_swapcool.cfg");
+    for(double kmax: {20, 40, 80, 160}) {
+        config["max_momentum"] = kmax;
+        config["min_momentum"] = -kmax;
+        HMotion hamil(config);
+        double rate = hmotion_rate(hamil);
+        unsigned long elements = hamil.handler.size();
+        std::cerr << "HMotion k in [" << -kmax << ", " << kmax << "]: "
+            << rate << " evaluations/s" << std::endl;
+
+        results.begin_record();
+        results.field("max_momentum", kmax);
+        results.field("elements", elements);
+        results.field("evals_per_s", rate);
+        results.field("elements_per_s", rate*elements);
+        results.end_record();
+    }
+}
+
+// Dormand-Prince steps per second, all from the same state and with a time
+// step small enough to be accepted first time, with the stage combinations
+// split like the derivative
+double hmotion_step_rate(HMotion& hamil) {
+    const std::vector<std::complex<double>> rho_start = hmotion_state(hamil);
+    std::vector<std::complex<double>> rho_c;
+    const double dt = 1e-4;
+    timestepping::inplace::DormandPrince<std::complex<double>> stepper(1e-6,
+        dt, 0.9, 4, 100, 0, hamil.loop_parts());
+    return calls_per_second([&]() {
+        rho_c = rho_start;
+        stepper.reset();
+        stepper.set_dt(dt);
+        stepper.step(0, rho_c, hamil);
+    });
+}
+
+// Derivative and whole step scaling with the number of threads, in powers
+// of 2 up to the number of hardware threads, at the largest momentum range
+// above
+void bench_hmotion_threads(JsonRecords& results) {
+    results.begin_group("hmotion_threads");
+    auto config = read_config("../config/params_swapcool.cfg");
+    config["max_momentum"] = 160;
+    config["min_momentum"] = -160;
+    HMotion hamil(config);
+    unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    double serial_rate = 0, serial_step_rate = 0;
+    for(unsigned n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        hamil.set_threads(n_threads);
+        double rate = hmotion_rate(hamil);
+        double step_rate = hmotion_step_rate(hamil);
+        if(n_threads == 1) {
+            serial_rate = rate;
+            serial_step_rate = step_rate;
+        }
+        std::cerr << "HMotion " << n_threads << " threads: " << rate
+            << " evaluations/s, " << step_rate << " steps/s" << std::endl;
+
+        results.begin_record();
+        results.field("threads", static_cast<unsigned long>(n_threads));
+        results.field("evals_per_s", rate);
+        results.field("speedup", rate/serial_rate);
+        results.field("steps_per_s", step_rate);
+        results.field("step_speedup", step_rate/serial_step_rate);
+        results.end_record();
+    }
+}
+
+// Derivative with the coherences limited to a band, at the largest momentum
+// range above. A bandwidth of 0 stores them all
+void bench_hmotion_banded(JsonRecords& results) {
+    results.begin_group("hmotion_banded");
+    auto config = read_config("../config/params_swapcool.cfg");
+    config["max_momentum"] = 160;
+    config["min_momentum"] = -160;
+    for(double bandwidth: {10, 20, 40, 0}) {
+        config["coherence_bandwidth"] = bandwidth;
+        HMotion hamil(config);
+        double rate = hmotion_rate(hamil);
+        unsigned long elements = hamil.handler.size();
+        std::cerr << "HMotion bandwidth " << hamil.handler.maxdk << ": "
+            << rate << " evaluations/s" << std::endl;
+
+        results.begin_record();
+        results.field("bandwidth",
+            static_cast<unsigned long>(hamil.handler.maxdk));
+        results.field("elements", elements);
+        results.field("evals_per_s", rate);
+        results.end_record();
+    }
+}
+
+// Derivative with the density matrix in double and single precision, at the
+// largest momentum range above
+void bench_hmotion_precision(JsonRecords& results) {
+    results.begin_group("hmotion_precision");
+    auto config = read_config("../config/params_swapcool.cfg");
+    config["max_momentum"] = 160;
+    config["min_momentum"] = -160;
+    HMotion hamil(config);
+    for(bool single: {false, true}) {
+        double rate = single ? hmotion_rate<float>(hamil)
+            : hmotion_rate<double>(hamil);
+        std::string precision = single ? "single" : "double";
+        std::cerr << "HMotion " << precision << " precision: " << rate
+            << " evaluations/s" << std::endl;
+
+        results.begin_record();
+        results.field("precision", precision);
+        results.field("evals_per_s", rate);
+        results.end_record();
+    }
+}
+
+// Times whole solves of one problem with every run time selectable scheme
+template<typename dtype, typename DerivFn>
+void bench_problem(JsonRecords& results, std::string problem,
+    DerivFn deriv, const std::vector<dtype>& y0, double t_final,
+    const std::vector<dtype>& lin) {
+    using namespace timestepping::inplace;
+    for(adaptive_scheme scheme: {step_doubling, dormand_prince, cash_karp,
+        lawson_dormand_prince, rosenbrock, auto_stiffness}) {
+        // The Lawson scheme only makes sense with a linear part
+        if(scheme == lawson_dormand_prince && lin.empty()) continue;
+        AdaptiveOptions<dtype> opts;
+        opts.scheme = scheme;
+        opts.tol = 1e-6;
+        opts.lin = lin;
+        StepStats stats;
+        double rate = calls_per_second([&]() {
+            with_adaptive_stepper(opts, [&](auto& stepper) {
+                std::vector<dtype> y = y0;
+                double t = 0;
+                while(t < t_final) {
+                    t = stepper.step(t, y, deriv);
+                }
+                stats = stepper.stats();
+                return t;
+            });
+        });
+        std::cerr << problem << " " << adaptive_scheme_name(scheme) << ": "
+            << rate*stats.accepted << " steps/s" << std::endl;
+
+        results.begin_record();
+        results.field("problem", problem);
+        results.field("stepper", adaptive_scheme_name(scheme));
+        results.field("accepted", stats.accepted);
+        results.field("rejected", stats.rejected);
+        results.field("deriv_evals", stats.deriv_evals);
+        results.field("solves_per_s", rate);
+        results.field("steps_per_s", rate*stats.accepted);
+        results.end_record();
+    }
+}
+
+void bench_steppers(JsonRecords& results) {
+    results.begin_group("steppers");
+    const double k = 5, f = 1, w = 200, lambda = -1e4;
+    const double t_final = 10;
+    bench_problem<double>(results, "oscillator",
+        [k](double, const std::vector<double>& y, std::vector<double>& dy) {
+            dy = {y[1], -k*y[0]};
+        }, {1, 0}, t_final, {});
+    bench_problem<std::complex<double>>(results, "cexp",
+        [f](double, const std::vector<std::complex<double>>& y,
+            std::vector<std::complex<double>>& dy) {
+            dy = {2.*M_PI*1i*f*y[0]};
+        }, {1}, t_final, {});
+    bench_problem<std::complex<double>>(results, "fastrot",
+        [f, w](double, const std::vector<std::complex<double>>& y,
+            std::vector<std::complex<double>>& dy) {
+            dy = {1i*(2.*M_PI*f + w)*y[0]};
+        }, {1}, t_final, {1i*w});
+    bench_problem<double>(results, "stiff",
+        [lambda](double t, const std::vector<double>& y,
+            std::vector<double>& dy) {
+            dy = {lambda*(y[0] - std::cos(t)) - std::sin(t)};
+        }, {1}, t_final, {});
+}
+
+void bench_table_writers(JsonRecords& results) {
+    results.begin_group("table_writers");
+    const unsigned long rows = 1 << 18, ncols = 8;
+    std::vector<double> row(ncols);
+    for(bool binary: {false, true}) {
+        std::string fname = TABLE_TMPFILE + (binary ? ".npy" : ".out");
+        unsigned long bytes = 0;
+        double rate = calls_per_second([&]() {
+            auto writer = make_table_writer(fname, ncols, binary);
+            for(unsigned long i = 0; i < rows; ++i) {
+                for(unsigned j = 0; j < ncols; ++j) {
+                    row[j] = i*1e-3 + j;
+                }
+                writer->write_row(row);
+            }
+            writer->close();
+            std::ifstream written(fname, std::ios::binary | std::ios::ate);
+            bytes = written.tellg();
+        });
+        std::remove(fname.c_str());
+        std::string format = binary ? "npy" : "text";
+        std::cerr << format << " table: " << rate*bytes/1e6 << " MB/s"
+            << std::endl;
+
+        results.begin_record();
+        results.field("format", format);
+        results.field("rows", rows);
+        results.field("columns", ncols);
+        results.field("bytes", bytes);
+        results.field("rows_per_s", rate*rows);
+        results.field("mb_per_s", rate*bytes/1e6);
+        results.end_record();
+    }
+}
+
+int main(int argc, char** argv) {
+    if(argc > 2) {
+        std::cerr << "Usage: " << argv[0] << " [<JSON output file>]"
+            << std::endl;
+        return 1;
+    }
+    JsonRecords results;
+    bench_optmol(results);
+    bench_hmotion(results);
+    bench_hmotion_threads(results);
+    bench_hmotion_banded(results);
+    bench_hmotion_precision(results);
+    bench_steppers(results);
+    bench_table_writers(results);
+
+    if(argc > 1) {
+        std::ofstream outfile(argv[1]);
+        outfile << results.str();
+    } else {
+        std::cout << results.str();
+    }
+}
@@ -13,6 +13,9 @@ std::string tag_filename(std::string, std::string,
 std::string tag_filename(std::string, std::vector<std::string>,
     std::string prefix = "", std::string separator = "_");
 
+// Replace the extension of a filename (everything from the last ".")
+std::string replace_extension(std::string, std::string);
+
 // Synthesize a filename and a directory
 std::string fullfile(std::string, std::string);
 // Separate a path into a filename and a directory
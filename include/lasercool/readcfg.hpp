@@ -7,6 +7,7 @@
 #include <sstream>
 #include <vector>
 #include <utility>
+#include <stdexcept>
 #include <unordered_map>
 // Reads all name-value pairs in a config file and returns them in a map
 // Default delimiter is a colon.
@@ -16,5 +17,16 @@ std::unordered_map<std::string, double> read_config(std::string,
 // Loads specified parameters into variables, passed as pointers
 void load_params(std::string, std::vector< std::pair<std::string, double*> >,
     std::string delimiter = ":");
+// Same as above, but from name-value pairs that were already read in
+void load_params(const std::unordered_map<std::string, double>&,
+    std::vector< std::pair<std::string, double*> >);
+// Reads parameter sweep specifications from a file, in file order. Each line
+// gives a name and its values, either as a comma-separated list or as an
+// inclusive, evenly spaced range written as start:stop:count (with the
+// default delimiter). Comments are preceded by "#". Throws
+// std::runtime_error if the file can't be read, is malformed, or gives no
+// parameters
+std::vector< std::pair<std::string, std::vector<double> > > read_sweep(
+    std::string, std::string delimiter = ":");
 
 #endif
\ No newline at end of file
@@ -0,0 +1,63 @@
+#ifndef TABLEIO_HPP_
+#define TABLEIO_HPP_
+
+#include <string>
+#include <fstream>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+
+// Buffered writers for numeric output tables. A table has a fixed number of
+// columns and grows by whole rows. A table with 0 columns is a flat list of
+// values instead.
+class TableWriter {
+    protected:
+        std::vector<char> buffer;   // Stream buffer, must outlive the stream
+        std::ofstream out;
+        unsigned long ncols, nvalues;
+
+        TableWriter(unsigned long, std::size_t);
+        void open(const std::string&, std::ios_base::openmode);
+    public:
+        virtual ~TableWriter() {}
+        // Append values. With nonzero columns, the count must be a whole
+        // number of rows
+        virtual void write(const double*, unsigned long) = 0;
+        void write_row(const std::vector<double>& row) {
+            write(row.data(), row.size());
+        }
+        virtual void close() {out.close();}
+        unsigned long size() const {return nvalues;}
+};
+
+// Human-readable text. Columns are separated by spaces and rows by newlines,
+// and a flat list is written as a single space-separated line
+class TextTableWriter : public TableWriter {
+    public:
+        TextTableWriter(std::string, unsigned long ncols=0,
+            std::size_t buffer_bytes=1<<22);
+        void write(const double*, unsigned long) override;
+};
+
+// NumPy .npy array of little-endian doubles, loadable with numpy.load().
+// Has shape (rows, columns), or (values,) for a flat list. The header
+// reserves room for the shape, which is filled in on close()
+class NpyTableWriter : public TableWriter {
+    private:
+        void write_header();
+    public:
+        // Fixed header size, including the magic string
+        static const unsigned header_bytes = 128;
+
+        NpyTableWriter(std::string, unsigned long ncols=0,
+            std::size_t buffer_bytes=1<<22);
+        ~NpyTableWriter();
+        void write(const double*, unsigned long) override;
+        void close() override;
+};
+
+// Opens a table of the given format
+std::unique_ptr<TableWriter> make_table_writer(std::string, unsigned long,
+    bool binary);
+
+#endif
@@ -0,0 +1,109 @@
+// Fixed-size pool of persistent worker threads for fork-join parallelism
+#ifndef THREADPOOL_HPP_
+#define THREADPOOL_HPP_
+
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+// The calling thread takes part in every job as thread 0, so a pool of
+// size 1 never spawns any threads and runs jobs inline.
+class ThreadPool {
+    private:
+        std::vector<std::thread> workers;
+        std::mutex mtx;
+        std::condition_variable start_cv, done_cv;
+        std::function<void(unsigned)> job;
+        // Incremented for every new job, so sleeping workers can tell a new
+        // job from a spurious wakeup
+        unsigned long generation;
+        unsigned n_busy;
+        bool stopping;
+        std::exception_ptr error;
+
+        void run_guarded(unsigned tid) {
+            try {
+                job(tid);
+            } catch(...) {
+                std::lock_guard<std::mutex> lock(mtx);
+                if(!error) error = std::current_exception();
+            }
+        }
+
+        void worker_loop(unsigned tid) {
+            unsigned long seen = 0;
+            while(true) {
+                {
+                    std::unique_lock<std::mutex> lock(mtx);
+                    start_cv.wait(lock,
+                        [&]{return stopping || generation != seen;});
+                    if(stopping) return;
+                    seen = generation;
+                }
+                run_guarded(tid);
+                {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    if(--n_busy == 0) done_cv.notify_one();
+                }
+            }
+        }
+    public:
+        // 0 threads means one per hardware thread
+        ThreadPool(unsigned n_threads=1)
+            :generation(0), n_busy(0), stopping(false) {
+            if(n_threads == 0) {
+                n_threads = std::max(1u, std::thread::hardware_concurrency());
+            }
+            workers.reserve(n_threads - 1);
+            for(unsigned tid = 1; tid < n_threads; ++tid) {
+                workers.emplace_back(&ThreadPool::worker_loop, this, tid);
+            }
+        }
+        ThreadPool(const ThreadPool&) = delete;
+        ThreadPool& operator=(const ThreadPool&) = delete;
+        ~ThreadPool() {
+            {
+                std::lock_guard<std::mutex> lock(mtx);
+                stopping = true;
+            }
+            start_cv.notify_all();
+            for(auto& w: workers) {
+                w.join();
+            }
+        }
+
+        unsigned size() const {return workers.size() + 1;}
+
+        // Call f(thread index) once on every thread and wait for all of them
+        // to finish. Rethrows the first exception thrown by any thread
+        void run(std::function<void(unsigned)> f) {
+            job = std::move(f);
+            error = nullptr;
+            if(!workers.empty()) {
+                std::lock_guard<std::mutex> lock(mtx);
+                n_busy = workers.size();
+                ++generation;
+            }
+            start_cv.notify_all();
+            run_guarded(0);
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                done_cv.wait(lock, [&]{return n_busy == 0;});
+            }
+            if(error) std::rethrow_exception(error);
+        }
+
+        // Contiguous [begin, end) share of n items belonging to a thread
+        std::pair<unsigned, unsigned> chunk(unsigned n, unsigned tid) const {
+            unsigned long nl = n, nthr = size();
+            return std::make_pair(static_cast<unsigned>(nl*tid/nthr),
+                static_cast<unsigned>(nl*(tid + 1)/nthr));
+        }
+};
+
+#endif
@@ -9,163 +9,1578 @@
 #include <utility>
 #include <limits>
 #include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <sstream>
+#include <functional>
 // Not used directly, but circumvents the need to #include <complex>
 // before doing #include "timestepping.hpp" in other files.
 #include <complex>
 
 namespace timestepping {
 
-// ODE solver using some time-stepping scheme
+// Allocation-free steppers. These advance a state in place, keeping their
+// stage buffers between steps, and take derivatives of the form
+// DerivFn(double t, const vector<dtype>& y, vector<dtype>& dy) -> void,
+// which overwrite dy (resized to match y) instead of returning a new vector.
+// Vector updates are fused AXPY-style loops with a real coefficient.
+namespace inplace {
+
+// Real scalar type of a (possibly complex) value type
+template<typename dtype>
+struct real_of {typedef dtype type;};
+template<typename T>
+struct real_of<std::complex<T>> {typedef T type;};
+
+// y += c*x
+template<typename dtype>
+void axpy(std::vector<dtype>& y, typename real_of<dtype>::type c,
+    const std::vector<dtype>& x) {
+    for(unsigned i = 0; i < y.size(); ++i) {
+        y[i] += c*x[i];
+    }
+}
+// z = y + c*x
+template<typename dtype>
+void axpy(std::vector<dtype>& z, const std::vector<dtype>& y,
+    typename real_of<dtype>::type c, const std::vector<dtype>& x) {
+    z.resize(y.size());
+    for(unsigned i = 0; i < y.size(); ++i) {
+        z[i] = c*x[i] + y[i];
+    }
+}
+
+// Splits the steppers' loops over the components of a state into parts,
+// which may run at once, e.g. on the threads computing the derivative.
+// run(n, body) calls body(part, begin, end) once for each of the parts of
+// [0, n), with part < parts. Without run, a loop is one part on the calling
+// thread
+struct LoopParts {
+    unsigned parts = 1;
+    std::function<void(unsigned,
+        const std::function<void(unsigned, unsigned, unsigned)>&)> run;
+
+    // Calls body(begin, end) for each part of [0, n)
+    template<typename Body>
+    void each(unsigned n, Body&& body) const {
+        if(!run) {
+            body(0u, n);
+            return;
+        }
+        run(n, [&](unsigned, unsigned begin, unsigned end) {
+            body(begin, end);
+        });
+    }
+
+    // Sum of body(begin, end) over the parts of [0, n), added in part order
+    // so the result doesn't depend on which part finishes first
+    template<typename Body>
+    double sum(unsigned n, Body&& body) const {
+        if(!run) return body(0u, n);
+        std::vector<double> part_sums(parts, 0);
+        run(n, [&](unsigned part, unsigned begin, unsigned end) {
+            part_sums[part] = body(begin, end);
+        });
+        double total = 0;
+        for(double part_sum: part_sums) {
+            total += part_sum;
+        }
+        return total;
+    }
+
+    // Largest body(begin, end) over the parts of [0, n)
+    template<typename Body>
+    double max(unsigned n, Body&& body) const {
+        if(!run) return body(0u, n);
+        std::vector<double> part_maxes(parts, 0);
+        run(n, [&](unsigned part, unsigned begin, unsigned end) {
+            part_maxes[part] = body(begin, end);
+        });
+        return *std::max_element(part_maxes.begin(), part_maxes.end());
+    }
+};
+
+// z = y + c*x, split into parts
+template<typename dtype>
+void axpy(const LoopParts& loop_parts, std::vector<dtype>& z,
+    const std::vector<dtype>& y, typename real_of<dtype>::type c,
+    const std::vector<dtype>& x) {
+    z.resize(y.size());
+    loop_parts.each(y.size(), [&](unsigned begin, unsigned end) {
+        for(unsigned i = begin; i < end; ++i) {
+            z[i] = c*x[i] + y[i];
+        }
+    });
+}
+
+// Wraps a value-returning derivative, DerivFn(double t, vector<dtype> y) ->
+// vector<dtype> dy, in the in-place signature
+template<typename DerivFn>
+struct ValueDeriv {
+    DerivFn& deriv;
+
+    template<typename dtype>
+    void operator()(double t, const std::vector<dtype>& y,
+        std::vector<dtype>& dy) {
+        dy = deriv(t, y);
+    }
+};
+template<typename DerivFn>
+ValueDeriv<DerivFn> value_deriv(DerivFn& deriv) {
+    return ValueDeriv<DerivFn>{deriv};
+}
+
+// ODE solver using an in-place time-stepping scheme
 // Returns (time values, state values)
-// DerivFn(double t, vector<dtype> y) -> vector<dtype> dy
-// Timestepper(double t, vector<dtype> y, DerivFn deriv) -> (new_t, new_y)
-template<typename dtype, typename DerivFn, typename Timestepper>
+// Stepper.step(double t, vector<dtype>& y, DerivFn& deriv) -> new_t
+template<typename dtype, typename DerivFn, typename Stepper>
 std::vector<std::pair<double, std::vector<dtype>>> odesolve(
-    DerivFn deriv, const std::vector<dtype>& y0, double t_final,
-    Timestepper step) {
+    DerivFn&& deriv, const std::vector<dtype>& y0, double t_final,
+    Stepper&& stepper) {
 
     std::vector<std::pair<double, std::vector<dtype>>>
         odesolution{{0, y0}};
-    while(odesolution.back().first < t_final) {
+    double t = 0;
+    std::vector<dtype> y(y0);
+    while(t < t_final) {
         try {
-            odesolution.push_back(step(
-                odesolution.back().first, odesolution.back().second, deriv));
+            t = stepper.step(t, y, deriv);
         } catch(const std::exception &e) {
             std::cout << e.what() << std::endl;
             break;
         }
+        odesolution.emplace_back(t, y);
     }
     return odesolution;
 }
 
-// Supporting function
-// c1*v1 + c2*v2
+// Cubic Hermite interpolation between (t0, y0) and (t0 + h, y1), with
+// derivatives dy0 and dy1, at t0 + theta*h
 template<typename dtype>
-std::vector<dtype> vlincombo(const std::vector<dtype>& v1,
-    const std::vector<dtype>& v2, dtype c1=1, dtype c2=1) {
-    std::vector<dtype> vsum;
-    vsum.reserve(v1.size());
-    for(unsigned i = 0; i < v1.size(); ++i) {
-        vsum.push_back(c1*v1[i] + c2*v2[i]);
+void hermite(std::vector<dtype>& y, const std::vector<dtype>& y0,
+    const std::vector<dtype>& dy0, const std::vector<dtype>& y1,
+    const std::vector<dtype>& dy1, double h, double theta) {
+    typedef typename real_of<dtype>::type real;
+    const real c_y0 = (1 + 2*theta)*(1 - theta)*(1 - theta);
+    const real c_dy0 = h*theta*(1 - theta)*(1 - theta);
+    const real c_y1 = theta*theta*(3 - 2*theta);
+    const real c_dy1 = h*theta*theta*(theta - 1);
+    y.resize(y0.size());
+    for(unsigned i = 0; i < y0.size(); ++i) {
+        y[i] = c_y0*y0[i] + c_dy0*dy0[i] + c_y1*y1[i] + c_dy1*dy1[i];
     }
-    return vsum;
+}
+
+// Streaming ODE solver using an in-place time-stepping scheme
+// Advances y from t = 0 until at least t_final, without storing the
+// trajectory, and returns the final time. Calls
+// Observer(double t, const vector<dtype>& y) at each of the ascending
+// observation times in t_obs that is reached, with the state interpolated
+// between accepted steps (dense output). A step that fails throws, rather
+// than returning a truncated solution.
+template<typename dtype, typename DerivFn, typename Stepper,
+    typename Observer>
+double odesolve(DerivFn&& deriv, std::vector<dtype>& y, double t_final,
+    Stepper&& stepper, const std::vector<double>& t_obs,
+    Observer&& observe) {
+
+    double t = 0;
+    auto obs = t_obs.begin();
+    for(; obs != t_obs.end() && *obs <= t; ++obs) {
+        observe(*obs, y);
+    }
+    // Endpoints of the latest step, for interpolation. Only kept while
+    // there are observation times left
+    std::vector<dtype> y_prev, dy_prev, dy, y_obs;
+    while(t < t_final) {
+        double t_prev = t;
+        if(obs != t_obs.end()) {
+            y_prev = y;
+        }
+        t = stepper.step(t, y, deriv);
+        // Endpoint derivatives are only needed when the step passes an
+        // observation time, which is rare with fine steps
+        if(obs != t_obs.end() && *obs <= t) {
+            deriv(t_prev, y_prev, dy_prev);
+            deriv(t, y, dy);
+            for(; obs != t_obs.end() && *obs <= t; ++obs) {
+                hermite(y_obs, y_prev, dy_prev, y, dy, t - t_prev,
+                    (*obs - t_prev)/(t - t_prev));
+                observe(*obs, y_obs);
+            }
+        }
+    }
+    return t;
 }
 
 // 2nd-order Runge-Kutta scheme
+template<typename dtype>
 class RK2 {
     private:
         double dt;
+        std::vector<dtype> dy, y_mid;
     public:
         RK2(double dt):dt(dt) {}
 
-        template<typename dtype, typename DerivFn>
-        std::pair<double, std::vector<dtype>> operator()(
-            double t, const std::vector<dtype>& y, DerivFn deriv) {
-            std::vector<dtype> dy = deriv(t, y);
+        template<typename DerivFn>
+        double step(double t, std::vector<dtype>& y, DerivFn&& deriv) {
+            deriv(t, y, dy);
             // Make a full step using half-step peek values
-            dy = deriv(t + dt/2, vlincombo<dtype>(dy, y, dt/2));
-            return std::make_pair(t + dt, vlincombo<dtype>(dy, y, dt));
+            axpy(y_mid, y, dt/2, dy);
+            deriv(t + dt/2, y_mid, dy);
+            axpy(y, dt, dy);
+            return t + dt;
         }
 };
 
 // 4th-order Runge-Kutta scheme
+template<typename dtype>
 class RK4 {
     private:
         double dt;
+        LoopParts loop_parts;
+        std::vector<dtype> dy1, dy2, dy3, dy4, y_peek;
     public:
-        RK4(double dt):dt(dt) {}
+        RK4(double dt, const LoopParts& loop_parts={})
+            :dt(dt), loop_parts(loop_parts) {}
 
         void set_dt(double dt) {
             this->dt = dt;
         }
 
-        template<typename dtype, typename DerivFn>
-        std::pair<double, std::vector<dtype>> operator()(
-            double t, const std::vector<dtype>& y, DerivFn deriv) {
+        template<typename DerivFn>
+        double step(double t, std::vector<dtype>& y, DerivFn&& deriv) {
+            deriv(t, y, dy1);
+            return step(t, y, deriv, dy1);
+        }
+
+        // Step with the derivative at the start of the step, dy1, known
+        template<typename DerivFn>
+        double step(double t, std::vector<dtype>& y, DerivFn&& deriv,
+            const std::vector<dtype>& dy1) {
+            typedef typename real_of<dtype>::type real;
             // Estimate derivative as quadrature of four points:
             // dy1, dy2, dy3, dy4
-            std::vector<dtype> dy1 = deriv(t, y);
-            std::vector<dtype> dy2 = deriv(t + dt/2, vlincombo<dtype>(dy1, y, dt/2));
-            std::vector<dtype> dy3 = deriv(t + dt/2, vlincombo<dtype>(dy2, y, dt/2));
-            std::vector<dtype> dy4 = deriv(t + dt, vlincombo<dtype>(dy3, y, dt));
+            axpy(loop_parts, y_peek, y, dt/2, dy1);
+            deriv(t + dt/2, y_peek, dy2);
+            axpy(loop_parts, y_peek, y, dt/2, dy2);
+            deriv(t + dt/2, y_peek, dy3);
+            axpy(loop_parts, y_peek, y, dt, dy3);
+            deriv(t + dt, y_peek, dy4);
             // Make a full step using the quadrature derivative estimate
-            std::vector<dtype> y_new;
-            y_new.reserve(y.size());
-            for(unsigned i = 0; i < y.size(); ++i) {
-                // Need static cast if dtype is something like std::complex<float>
-                y_new.push_back(
-                    y[i] + static_cast<dtype>(dt/6)
-                    * (dy1[i] + static_cast<dtype>(2)*(dy2[i] + dy3[i]) + dy4[i])
-                );
+            const real c = dt/6;
+            loop_parts.each(y.size(), [&](unsigned begin, unsigned end) {
+                for(unsigned i = begin; i < end; ++i) {
+                    y[i] += c*(dy1[i] + real(2)*(dy2[i] + dy3[i]) + dy4[i]);
+                }
+            });
+            return t + dt;
+        }
+};
+
+// Counters for an adaptive stepper
+struct StepStats {
+    unsigned long accepted = 0;
+    unsigned long rejected = 0;
+    unsigned long deriv_evals = 0;  // Made by the stepper itself
+    unsigned long implicit_steps = 0;   // Accepted steps of implicit schemes
+    unsigned long switches = 0; // Between explicit and implicit schemes
+    double min_dt = std::numeric_limits<double>::infinity();
+    double max_dt = 0;
+
+    // Record an accepted step
+    void record(double dt) {
+        ++accepted;
+        min_dt = std::min(min_dt, dt);
+        max_dt = std::max(max_dt, dt);
+    }
+
+    StepStats& operator+=(const StepStats& other) {
+        accepted += other.accepted;
+        rejected += other.rejected;
+        deriv_evals += other.deriv_evals;
+        implicit_steps += other.implicit_steps;
+        switches += other.switches;
+        min_dt = std::min(min_dt, other.min_dt);
+        max_dt = std::max(max_dt, other.max_dt);
+        return *this;
+    }
+};
+
+// Time step control for the adaptive steppers, from the ratio of the
+// estimated truncation error to the desired error. The error is taken to
+// scale as dt^(1/exponent), so exponent is 0.2 for 4/5-th order error
+// estimates.
+// With pi_beta = 0 this is a purely proportional controller. Otherwise it is
+// a proportional-integral (Gustafsson) controller that also weighs in the
+// error ratio of the last accepted step, which damps step size oscillations
+// (see Hairer & Wanner, Solving ODEs II, IV.2). ~0.04 is a typical pi_beta.
+class StepControl {
+    private:
+        double dt_shrink;   // Shrink factor on time step adjustment
+        double dt_adjust_lim;   // Max factor of adjustment in a single iteration
+        double pi_beta;
+        double exponent;
+        double prev_error_ratio;
+    public:
+        StepControl(double dt_shrink=0.9, double dt_adjust_lim=4,
+            double pi_beta=0, double exponent=0.2)
+            :dt_shrink(dt_shrink), dt_adjust_lim(dt_adjust_lim),
+            pi_beta(pi_beta), exponent(exponent), prev_error_ratio(1) {}
+
+        // Better time step than dt, which gave some error ratio
+        double adjust(double dt, double error_ratio) {
+            double factor;
+            if(pi_beta == 0) {
+                factor = dt_shrink * pow(error_ratio, -exponent);
+            } else {
+                factor = dt_shrink
+                    * pow(error_ratio, -(exponent - 0.75*pi_beta))
+                    * pow(prev_error_ratio, pi_beta);
+                if(error_ratio < 1) {
+                    // Bounded away from 0 as in Hairer & Wanner
+                    prev_error_ratio = std::max(error_ratio, 1e-4);
+                }
             }
-            return std::make_pair(t + dt, y_new);
+            return std::max(dt / dt_adjust_lim,
+                std::min(dt * dt_adjust_lim, dt * factor));
         }
 };
 
-// Adaptive 4/5-th order Runge-Kutta scheme
+// Counts the calls of a derivative, of a single time or of one per lane for
+// the batched steppers
+template<typename DerivFn>
+struct CountedDeriv {
+    DerivFn& deriv;
+    unsigned long& count;
+
+    template<typename Time, typename dtype>
+    void operator()(const Time& t, const std::vector<dtype>& y,
+        std::vector<dtype>& dy) {
+        ++count;
+        deriv(t, y, dy);
+    }
+};
+template<typename DerivFn>
+CountedDeriv<DerivFn> counted_deriv(DerivFn& deriv, unsigned long& count) {
+    return CountedDeriv<DerivFn>{deriv, count};
+}
+
+// Error for a step that failed even after many time step adjustments
+inline std::runtime_error step_failure(double t, double dt) {
+    std::ostringstream msg;
+    msg << "Maximum number of time step adjustments exceeded at t = " << t
+        << " (dt = " << dt << ")";
+    return std::runtime_error(msg.str());
+}
+
+// Adaptive 4/5-th order Runge-Kutta scheme, by step doubling
+template<typename dtype>
 class AdaptiveRK {
     private:
         double tol;
         double dt;
-        double dt_shrink;   // Shrink factor on time step adjustment
-        double dt_adjust_lim;   // Max factor of adjustment in a single iteration
         unsigned max_dt_adjusts;
+        StepControl control;
+        StepStats step_stats;
 
-        RK4 rk4stepper;
+        LoopParts loop_parts;
+        RK4<dtype> rk4stepper;
+        std::vector<dtype> dy_start, y_small, y_big;
     public:
         AdaptiveRK(double tol, double dt=1e-3,
             double dt_shrink=0.9, double dt_adjust_lim=4,
-            unsigned max_dt_adjusts=100)
-            :tol(tol), dt(dt),
-            dt_shrink(dt_shrink), dt_adjust_lim(dt_adjust_lim),
-            max_dt_adjusts(max_dt_adjusts), rk4stepper(dt) {}
+            unsigned max_dt_adjusts=100, double pi_beta=0,
+            const LoopParts& loop_parts={})
+            :tol(tol), dt(dt), max_dt_adjusts(max_dt_adjusts),
+            control(dt_shrink, dt_adjust_lim, pi_beta),
+            loop_parts(loop_parts), rk4stepper(dt, loop_parts) {}
 
-        template<typename dtype, typename DerivFn>
-        std::pair<double, std::vector<dtype>> operator()(
-            double t, const std::vector<dtype>& y, DerivFn deriv) {
-            
+        // Time step to try next
+        double get_dt() const {return dt;}
+
+        const StepStats& stats() const {return step_stats;}
+
+        template<typename DerivFn>
+        double step(double t, std::vector<dtype>& y, DerivFn&& deriv_fn) {
+            auto deriv = counted_deriv(deriv_fn, step_stats.deriv_evals);
+            // Shared by the first half-step and the full step, and
+            // independent of the time step
+            deriv(t, y, dy_start);
             for(unsigned i = 0; i < max_dt_adjusts; ++i) {
                 // Time after the step
                 double t_new = t + dt;
 
                 // Two half-steps
                 rk4stepper.set_dt(dt/2);
-                std::vector<dtype> y_small = rk4stepper(t + dt/2,
-                    rk4stepper(t, y, deriv).second, deriv).second;
+                y_small = y;
+                rk4stepper.step(t, y_small, deriv, dy_start);
+                rk4stepper.step(t + dt/2, y_small, deriv);
 
                 // One full step
                 rk4stepper.set_dt(dt);
-                std::vector<dtype> y_big = rk4stepper(t, y, deriv).second;
+                y_big = y;
+                rk4stepper.step(t, y_big, deriv, dy_start);
 
                 // Estimate maximum relative truncation error of any component
+                double error_ratio = loop_parts.max(y_small.size(),
+                    [&](unsigned begin, unsigned end) {
+                    double part_ratio = 0;
+                    for(unsigned cmp = begin; cmp < end; ++cmp) {
+                        // Buffer by the numeric double precision limit
+                        double desired_err = tol *
+                            (std::abs(y_small[cmp]) + std::abs(y_big[cmp]))/2
+                            + std::numeric_limits<double>::epsilon();
+                        part_ratio = std::max(part_ratio,
+                            std::abs(y_small[cmp] - y_big[cmp])
+                            / desired_err);
+                    }
+                    return part_ratio;
+                });
+
+                // Estimate better time step
+                // This persists for the next time step if no more adjustments
+                // are needed
+                double dt_tried = dt;
+                dt = control.adjust(dt, error_ratio);
+
+                // Check if the error is within the desired tolerance
+                if(error_ratio < 1) {
+                    // Keep the calculation with the smaller time step
+                    y.swap(y_small);
+                    step_stats.record(dt_tried);
+                    return t_new;
+                }
+                ++step_stats.rejected;
+            }
+
+            // Give up after too many adjustments
+            throw step_failure(t, dt);
+        }
+};
+
+// Butcher tableaus of embedded Runge-Kutta pairs, in a given real type.
+// b holds the weights of the higher-order solution, and e the differences
+// from the lower-order weights, giving the truncation error estimate.
+// With first same as last (fsal), the final stage is evaluated at the new
+// state, so it is the first stage of the next step.
+namespace tableaus {
+
+// Dormand-Prince 5(4)
+template<typename real>
+struct DormandPrince54 {
+    static const unsigned stages = 7;
+    static const bool fsal = true;
+    static const real c[7], a[7][7], b[7], e[7];
+};
+template<typename real>
+const real DormandPrince54<real>::c[7] =
+    {0, real(1)/5, real(3)/10, real(4)/5, real(8)/9, 1, 1};
+template<typename real>
+const real DormandPrince54<real>::a[7][7] = {
+    {},
+    {real(1)/5},
+    {real(3)/40, real(9)/40},
+    {real(44)/45, real(-56)/15, real(32)/9},
+    {real(19372)/6561, real(-25360)/2187, real(64448)/6561, real(-212)/729},
+    {real(9017)/3168, real(-355)/33, real(46732)/5247, real(49)/176,
+        real(-5103)/18656},
+    {real(35)/384, 0, real(500)/1113, real(125)/192, real(-2187)/6784,
+        real(11)/84}
+};
+template<typename real>
+const real DormandPrince54<real>::b[7] = {real(35)/384, 0, real(500)/1113,
+    real(125)/192, real(-2187)/6784, real(11)/84, 0};
+template<typename real>
+const real DormandPrince54<real>::e[7] = {real(71)/57600, 0,
+    real(-71)/16695, real(71)/1920, real(-17253)/339200, real(22)/525,
+    real(-1)/40};
+
+// Cash-Karp 5(4)
+template<typename real>
+struct CashKarp54 {
+    static const unsigned stages = 6;
+    static const bool fsal = false;
+    static const real c[6], a[6][6], b[6], e[6];
+};
+template<typename real>
+const real CashKarp54<real>::c[6] =
+    {0, real(1)/5, real(3)/10, real(3)/5, 1, real(7)/8};
+template<typename real>
+const real CashKarp54<real>::a[6][6] = {
+    {},
+    {real(1)/5},
+    {real(3)/40, real(9)/40},
+    {real(3)/10, real(-9)/10, real(6)/5},
+    {real(-11)/54, real(5)/2, real(-70)/27, real(35)/27},
+    {real(1631)/55296, real(175)/512, real(575)/13824, real(44275)/110592,
+        real(253)/4096}
+};
+template<typename real>
+const real CashKarp54<real>::b[6] = {real(37)/378, 0, real(250)/621,
+    real(125)/594, 0, real(512)/1771};
+template<typename real>
+const real CashKarp54<real>::e[6] = {real(37)/378 - real(2825)/27648, 0,
+    real(250)/621 - real(18575)/48384, real(125)/594 - real(13525)/55296,
+    real(-277)/14336, real(512)/1771 - real(1)/4};
+
+}
+
+// Adaptive embedded Runge-Kutta scheme, with the truncation error estimated
+// from the difference between the two solutions of an embedded pair, and
+// the same time step control as AdaptiveRK.
+// With a first-same-as-last tableau, the final stage of an accepted step is
+// reused as the first stage of the next one if it starts where the last one
+// ended, so the state must not be modified between steps without reset().
+template<typename dtype, template<typename> class Tableau>
+class EmbeddedRK {
+    private:
+        typedef typename real_of<dtype>::type real;
+        typedef Tableau<real> tableau;
+
+        double tol;
+        double dt;
+        unsigned max_dt_adjusts;
+        StepControl control;
+        StepStats step_stats;
+        LoopParts loop_parts;
+
+        std::vector<std::vector<dtype>> k;  // Stage derivatives
+        std::vector<dtype> y_stage, y_new;
+        bool has_fsal;  // Whether k[0] holds the derivative at t_fsal
+        double t_fsal;
+        double stiffness_ratio;
+    public:
+        EmbeddedRK(double tol, double dt=1e-3,
+            double dt_shrink=0.9, double dt_adjust_lim=4,
+            unsigned max_dt_adjusts=100, double pi_beta=0,
+            const LoopParts& loop_parts={})
+            :tol(tol), dt(dt), max_dt_adjusts(max_dt_adjusts),
+            control(dt_shrink, dt_adjust_lim, pi_beta),
+            loop_parts(loop_parts), k(tableau::stages),
+            has_fsal(false), t_fsal(0),
+            stiffness_ratio(std::numeric_limits<double>::quiet_NaN()) {}
+
+        // Time step to try next
+        double get_dt() const {return dt;}
+        void set_dt(double dt) {this->dt = dt;}
+
+        const StepStats& stats() const {return step_stats;}
+
+        // Discard the stored first stage
+        void reset() {has_fsal = false;}
+
+        // Estimate of dt*|lambda| over the last accepted step, for the
+        // dominant Jacobian eigenvalue lambda, or nan if the last two stages
+        // aren't at the same time (see Hairer & Wanner, Solving ODEs II,
+        // IV.2). Dormand-Prince is unstable past ~3.3 on the negative real
+        // axis
+        double stiffness() const {return stiffness_ratio;}
+
+        template<typename DerivFn>
+        double step(double t, std::vector<dtype>& y, DerivFn&& deriv_fn) {
+            auto deriv = counted_deriv(deriv_fn, step_stats.deriv_evals);
+            const unsigned n = y.size();
+            y_stage.resize(n);
+            y_new.resize(n);
+            // The first stage doesn't depend on the step size
+            if(!(has_fsal && t == t_fsal)) {
+                deriv(t, y, k[0]);
+            }
+            has_fsal = false;
+
+            const unsigned last = tableau::stages - 1;
+            const bool same_time_stages =
+                tableau::c[last] == tableau::c[last - 1];
+            for(unsigned i = 0; i < max_dt_adjusts; ++i) {
+                // Time after the step
+                double t_new = t + dt;
+
+                // Remaining stages, keeping the distance between the last two
+                double stage_dist_sqr = 0;
+                for(unsigned s = 1; s < tableau::stages; ++s) {
+                    double dist_sqr = loop_parts.sum(n,
+                        [&](unsigned begin, unsigned end) {
+                        double part_dist_sqr = 0;
+                        for(unsigned cmp = begin; cmp < end; ++cmp) {
+                            dtype incr = 0;
+                            for(unsigned j = 0; j < s; ++j) {
+                                incr += tableau::a[s][j]*k[j][cmp];
+                            }
+                            dtype y_cmp = y[cmp] + static_cast<real>(dt)*incr;
+                            if(s == last && same_time_stages) {
+                                part_dist_sqr +=
+                                    std::norm(y_cmp - y_stage[cmp]);
+                            }
+                            y_stage[cmp] = y_cmp;
+                        }
+                        return part_dist_sqr;
+                    });
+                    if(s == last && same_time_stages) {
+                        stage_dist_sqr = dist_sqr;
+                    }
+                    deriv(t + tableau::c[s]*dt, y_stage, k[s]);
+                }
+
+                // Higher-order solution, and the maximum relative truncation
+                // error of any component
+                double error_ratio = loop_parts.max(n,
+                    [&](unsigned begin, unsigned end) {
+                    double part_ratio = 0;
+                    for(unsigned cmp = begin; cmp < end; ++cmp) {
+                        dtype incr = 0, err = 0;
+                        for(unsigned j = 0; j < tableau::stages; ++j) {
+                            incr += tableau::b[j]*k[j][cmp];
+                            err += tableau::e[j]*k[j][cmp];
+                        }
+                        y_new[cmp] = y[cmp] + static_cast<real>(dt)*incr;
+                        err *= static_cast<real>(dt);
+                        // Buffer by the numeric double precision limit
+                        double desired_err = tol * (std::abs(y_new[cmp])
+                            + std::abs(y_new[cmp] - err))/2
+                            + std::numeric_limits<double>::epsilon();
+                        part_ratio = std::max(part_ratio,
+                            std::abs(err) / desired_err);
+                    }
+                    return part_ratio;
+                });
+
+                // Estimate better time step
+                // This persists for the next time step if no more adjustments
+                // are needed
+                double dt_tried = dt;
+                dt = control.adjust(dt, error_ratio);
+
+                // Check if the error is within the desired tolerance
+                if(error_ratio < 1) {
+                    stiffness_ratio = std::numeric_limits<double>::quiet_NaN();
+                    if(stage_dist_sqr > 0) {
+                        double deriv_dist_sqr = loop_parts.sum(n,
+                            [&](unsigned begin, unsigned end) {
+                            double part_dist_sqr = 0;
+                            for(unsigned cmp = begin; cmp < end; ++cmp) {
+                                part_dist_sqr += std::norm(
+                                    k[last][cmp] - k[last - 1][cmp]);
+                            }
+                            return part_dist_sqr;
+                        });
+                        stiffness_ratio = dt_tried
+                            * std::sqrt(deriv_dist_sqr / stage_dist_sqr);
+                    }
+                    y.swap(y_new);
+                    step_stats.record(dt_tried);
+                    if(tableau::fsal) {
+                        // The last stage was evaluated at (t_new, y_new)
+                        k[0].swap(k[tableau::stages - 1]);
+                        has_fsal = true;
+                        t_fsal = t_new;
+                    }
+                    return t_new;
+                }
+                ++step_stats.rejected;
+            }
+
+            // Give up after too many adjustments
+            throw step_failure(t, dt);
+        }
+};
+
+template<typename dtype>
+using DormandPrince = EmbeddedRK<dtype, tableaus::DormandPrince54>;
+template<typename dtype>
+using CashKarp = EmbeddedRK<dtype, tableaus::CashKarp54>;
+
+// Embedded Runge-Kutta scheme for a batch of independent systems of the same
+// size, each with its own time, time step and step control as in
+// EmbeddedRK. The systems are stored lane-major, with component cmp of lane
+// l at y[cmp*nlanes + l], so that loops over lanes are contiguous and can be
+// vectorized. Every call attempts one step on all the running lanes at once.
+// Lanes whose step is rejected are masked from the update and retry with a
+// smaller step on the next call, alongside the others.
+// DerivFn(const vector<double>& t, const vector<dtype>& y, vector<dtype>& dy)
+// with one time per lane.
+template<typename dtype, template<typename> class Tableau>
+class BatchEmbeddedRK {
+    private:
+        typedef typename real_of<dtype>::type real;
+        typedef Tableau<real> tableau;
+
+        unsigned nlanes;
+        double tol;
+        double dt0;
+        double dt_shrink, dt_adjust_lim;
+        unsigned max_dt_adjusts;
+        double pi_beta;
+        StepStats step_stats;
+
+        // Per lane
+        std::vector<double> dt, dt_step, t_stage, error_ratio;
+        std::vector<StepControl> control;
+        std::vector<unsigned> n_adjusts;    // Rejections in a row
+        std::vector<char> has_fsal;
+
+        std::vector<std::vector<dtype>> k;  // Stage derivatives
+        std::vector<dtype> y_stage, y_new, k_first;
+    public:
+        BatchEmbeddedRK(unsigned nlanes, double tol, double dt=1e-3,
+            double dt_shrink=0.9, double dt_adjust_lim=4,
+            unsigned max_dt_adjusts=100, double pi_beta=0)
+            :nlanes(nlanes), tol(tol), dt0(dt), dt_shrink(dt_shrink),
+            dt_adjust_lim(dt_adjust_lim), max_dt_adjusts(max_dt_adjusts),
+            pi_beta(pi_beta), dt(nlanes, dt), dt_step(nlanes),
+            t_stage(nlanes), error_ratio(nlanes),
+            control(nlanes, StepControl(dt_shrink, dt_adjust_lim, pi_beta)),
+            n_adjusts(nlanes, 0), has_fsal(nlanes, false), k(tableau::stages) {}
+
+        unsigned lanes() const {return nlanes;}
+        const StepStats& stats() const {return step_stats;}
+
+        // Restart the step control of a lane, for a new system in it
+        void reset_lane(unsigned lane) {
+            dt[lane] = dt0;
+            control[lane] = StepControl(dt_shrink, dt_adjust_lim, pi_beta);
+            n_adjusts[lane] = 0;
+            has_fsal[lane] = false;
+        }
+
+        // Attempts a step on every lane with t < t_final, advancing t and y
+        // of the lanes whose step is accepted. Returns the number of lanes
+        // still running afterwards
+        template<typename DerivFn>
+        unsigned step(std::vector<double>& t, std::vector<dtype>& y,
+            const std::vector<double>& t_final, DerivFn&& deriv_fn) {
+            auto deriv = counted_deriv(deriv_fn, step_stats.deriv_evals);
+            const unsigned n = y.size();
+            const unsigned ncmp = n / nlanes;
+            y_stage.resize(n);
+            y_new.resize(n);
+            for(auto& ks: k) {
+                ks.resize(n);
+            }
+
+            // Finished lanes take steps of size 0, which leave them be
+            for(unsigned l = 0; l < nlanes; ++l) {
+                dt_step[l] = t[l] < t_final[l] ? dt[l] : 0;
+            }
+
+            // The first stage doesn't depend on the step size
+            bool all_fsal = true;
+            for(unsigned l = 0; l < nlanes; ++l) {
+                all_fsal = all_fsal && has_fsal[l];
+            }
+            if(!all_fsal) {
+                deriv(t, y, k_first);
+                for(unsigned cmp = 0; cmp < ncmp; ++cmp) {
+                    for(unsigned l = 0; l < nlanes; ++l) {
+                        if(!has_fsal[l]) {
+                            k[0][cmp*nlanes + l] = k_first[cmp*nlanes + l];
+                        }
+                    }
+                }
+                std::fill(has_fsal.begin(), has_fsal.end(), true);
+            }
+
+            // Remaining stages
+            for(unsigned s = 1; s < tableau::stages; ++s) {
+                for(unsigned l = 0; l < nlanes; ++l) {
+                    t_stage[l] = t[l] + tableau::c[s]*dt_step[l];
+                }
+                for(unsigned cmp = 0; cmp < ncmp; ++cmp) {
+                    for(unsigned l = 0; l < nlanes; ++l) {
+                        unsigned i = cmp*nlanes + l;
+                        dtype incr = 0;
+                        for(unsigned j = 0; j < s; ++j) {
+                            incr += tableau::a[s][j]*k[j][i];
+                        }
+                        y_stage[i] = y[i] + static_cast<real>(dt_step[l])*incr;
+                    }
+                }
+                deriv(t_stage, y_stage, k[s]);
+            }
+
+            // Higher-order solution, and the maximum relative truncation
+            // error of any component of each lane
+            std::fill(error_ratio.begin(), error_ratio.end(), 0);
+            for(unsigned cmp = 0; cmp < ncmp; ++cmp) {
+                for(unsigned l = 0; l < nlanes; ++l) {
+                    unsigned i = cmp*nlanes + l;
+                    dtype incr = 0, err = 0;
+                    for(unsigned j = 0; j < tableau::stages; ++j) {
+                        incr += tableau::b[j]*k[j][i];
+                        err += tableau::e[j]*k[j][i];
+                    }
+                    y_new[i] = y[i] + static_cast<real>(dt_step[l])*incr;
+                    err *= static_cast<real>(dt_step[l]);
+                    // Buffer by the numeric double precision limit
+                    double desired_err = tol *
+                        (std::abs(y_new[i]) + std::abs(y_new[i] - err))/2
+                        + std::numeric_limits<double>::epsilon();
+                    error_ratio[l] = std::max(error_ratio[l],
+                        std::abs(err) / desired_err);
+                }
+            }
+
+            // Accept or reject each running lane
+            unsigned n_running = 0;
+            for(unsigned l = 0; l < nlanes; ++l) {
+                if(dt_step[l] == 0) continue;
+                dt[l] = control[l].adjust(dt[l], error_ratio[l]);
+                if(error_ratio[l] < 1) {
+                    for(unsigned cmp = 0; cmp < ncmp; ++cmp) {
+                        unsigned i = cmp*nlanes + l;
+                        y[i] = y_new[i];
+                        if(tableau::fsal) {
+                            // The last stage was evaluated at the new state
+                            k[0][i] = k[tableau::stages - 1][i];
+                        }
+                    }
+                    has_fsal[l] = tableau::fsal;
+                    t[l] += dt_step[l];
+                    n_adjusts[l] = 0;
+                    step_stats.record(dt_step[l]);
+                } else {
+                    ++step_stats.rejected;
+                    // Give up after too many adjustments
+                    if(++n_adjusts[l] >= max_dt_adjusts) {
+                        throw step_failure(t[l], dt[l]);
+                    }
+                }
+                n_running += t[l] < t_final[l];
+            }
+            return n_running;
+        }
+};
+
+template<typename dtype>
+using BatchDormandPrince = BatchEmbeddedRK<dtype, tableaus::DormandPrince54>;
+
+// Adaptive Lawson (integrating factor) Runge-Kutta scheme for
+// dy/dt = L*y + N(t, y), with a constant diagonal linear part L. The linear
+// part is integrated exactly by working in the variable exp(-L*t)*y, and only
+// N is integrated with an embedded Runge-Kutta pair. This removes the step
+// size limit from fast rotation in L, which should be (mostly) imaginary.
+// The derivative passed in is the full one, L*y + N(t, y), like for the
+// other steppers; L*y is subtracted off.
+// An empty L is taken to be zero, which reduces to EmbeddedRK.
+template<typename dtype, template<typename> class Tableau>
+class LawsonRK {
+    private:
+        typedef typename real_of<dtype>::type real;
+        typedef Tableau<real> tableau;
+
+        std::vector<dtype> lin;     // Diagonal of L
+        double tol;
+        double dt;
+        unsigned max_dt_adjusts;
+        StepControl control;
+        StepStats step_stats;
+        LoopParts loop_parts;
+
+        // Stage derivatives of N, rotated back to the start of the step
+        std::vector<std::vector<dtype>> k;
+        std::vector<dtype> y_stage, y_new;
+        std::vector<dtype> phase, phase_inv;    // exp(+-phase_dt*L)
+        double phase_dt;
+        bool has_fsal;  // Whether k[0] holds N at t_fsal
+        double t_fsal;
+
+        void set_phase(double h) {
+            if(h == phase_dt) return;
+            for(unsigned i = 0; i < lin.size(); ++i) {
+                phase[i] = std::exp(static_cast<real>(h)*lin[i]);
+                phase_inv[i] = std::exp(-static_cast<real>(h)*lin[i]);
+            }
+            phase_dt = h;
+        }
+
+        // N(t, y) from the full derivative
+        template<typename DerivFn>
+        void nonlinear(DerivFn& deriv, double t, const std::vector<dtype>& y,
+            std::vector<dtype>& dy) {
+            deriv(t, y, dy);
+            loop_parts.each(y.size(), [&](unsigned begin, unsigned end) {
+                for(unsigned i = begin; i < end; ++i) {
+                    dy[i] -= lin[i]*y[i];
+                }
+            });
+        }
+    public:
+        LawsonRK(const std::vector<dtype>& lin, double tol, double dt=1e-3,
+            double dt_shrink=0.9, double dt_adjust_lim=4,
+            unsigned max_dt_adjusts=100, double pi_beta=0,
+            const LoopParts& loop_parts={})
+            :lin(lin), tol(tol), dt(dt), max_dt_adjusts(max_dt_adjusts),
+            control(dt_shrink, dt_adjust_lim, pi_beta),
+            loop_parts(loop_parts), k(tableau::stages),
+            phase(lin.size(), 1), phase_inv(lin.size(), 1), phase_dt(0),
+            has_fsal(false), t_fsal(0) {}
+
+        // Time step to try next
+        double get_dt() const {return dt;}
+
+        const StepStats& stats() const {return step_stats;}
+
+        // Discard the stored first stage
+        void reset() {has_fsal = false;}
+
+        template<typename DerivFn>
+        double step(double t, std::vector<dtype>& y, DerivFn&& deriv_fn) {
+            auto deriv = counted_deriv(deriv_fn, step_stats.deriv_evals);
+            const unsigned n = y.size();
+            if(lin.empty()) {
+                lin.assign(n, 0);
+                phase.assign(n, 1);
+                phase_inv.assign(n, 1);
+            }
+            y_stage.resize(n);
+            y_new.resize(n);
+            // The first stage needs no rotation
+            if(!(has_fsal && t == t_fsal)) {
+                nonlinear(deriv, t, y, k[0]);
+            }
+            has_fsal = false;
+
+            for(unsigned i = 0; i < max_dt_adjusts; ++i) {
+                // Time after the step
+                double t_new = t + dt;
+
+                // Remaining stages
+                for(unsigned s = 1; s < tableau::stages; ++s) {
+                    set_phase(tableau::c[s]*dt);
+                    loop_parts.each(n, [&](unsigned begin, unsigned end) {
+                        for(unsigned cmp = begin; cmp < end; ++cmp) {
+                            dtype incr = 0;
+                            for(unsigned j = 0; j < s; ++j) {
+                                incr += tableau::a[s][j]*k[j][cmp];
+                            }
+                            y_stage[cmp] = phase[cmp]
+                                * (y[cmp] + static_cast<real>(dt)*incr);
+                        }
+                    });
+                    nonlinear(deriv, t + tableau::c[s]*dt, y_stage, k[s]);
+                    loop_parts.each(n, [&](unsigned begin, unsigned end) {
+                        for(unsigned cmp = begin; cmp < end; ++cmp) {
+                            k[s][cmp] *= phase_inv[cmp];
+                        }
+                    });
+                }
+
+                // Higher-order solution, and the maximum relative truncation
+                // error of any component
+                set_phase(dt);
+                double error_ratio = loop_parts.max(n,
+                    [&](unsigned begin, unsigned end) {
+                    double part_ratio = 0;
+                    for(unsigned cmp = begin; cmp < end; ++cmp) {
+                        dtype incr = 0, err = 0;
+                        for(unsigned j = 0; j < tableau::stages; ++j) {
+                            incr += tableau::b[j]*k[j][cmp];
+                            err += tableau::e[j]*k[j][cmp];
+                        }
+                        y_new[cmp] = phase[cmp]
+                            * (y[cmp] + static_cast<real>(dt)*incr);
+                        err *= phase[cmp]*static_cast<real>(dt);
+                        // Buffer by the numeric double precision limit
+                        double desired_err = tol * (std::abs(y_new[cmp])
+                            + std::abs(y_new[cmp] - err))/2
+                            + std::numeric_limits<double>::epsilon();
+                        part_ratio = std::max(part_ratio,
+                            std::abs(err) / desired_err);
+                    }
+                    return part_ratio;
+                });
+
+                // Estimate better time step
+                // This persists for the next time step if no more adjustments
+                // are needed
+                double dt_tried = dt;
+                dt = control.adjust(dt, error_ratio);
+
+                // Check if the error is within the desired tolerance
+                if(error_ratio < 1) {
+                    y.swap(y_new);
+                    step_stats.record(dt_tried);
+                    if(tableau::fsal) {
+                        // The last stage was evaluated at (t_new, y_new), and
+                        // has c = 1, so undo its rotation
+                        k[0].swap(k[tableau::stages - 1]);
+                        for(unsigned cmp = 0; cmp < n; ++cmp) {
+                            k[0][cmp] *= phase[cmp];
+                        }
+                        has_fsal = true;
+                        t_fsal = t_new;
+                    }
+                    return t_new;
+                }
+                ++step_stats.rejected;
+            }
+
+            // Give up after too many adjustments
+            throw step_failure(t, dt);
+        }
+};
+
+template<typename dtype>
+using LawsonDormandPrince = LawsonRK<dtype, tableaus::DormandPrince54>;
+
+// Real inner product, treating complex vectors as real vectors of twice the
+// length. This keeps the linear solver below valid for maps that are only
+// real-linear, like ones that conjugate some of the components
+template<typename dtype>
+double real_dot(const std::vector<dtype>& a, const std::vector<dtype>& b) {
+    double sum = 0;
+    for(unsigned i = 0; i < a.size(); ++i) {
+        sum += std::real(a[i])*std::real(b[i])
+            + std::imag(a[i])*std::imag(b[i]);
+    }
+    return sum;
+}
+
+class LinearSolveFailure : public std::runtime_error {
+    public:
+        using std::runtime_error::runtime_error;
+};
+
+// BiCGSTAB solver for a matrix-free linear system A*x = b, right
+// preconditioned by a diagonal (Jacobi) matrix, with its workspace kept
+// between solves
+template<typename dtype>
+class BiCGStab {
+    private:
+        typedef typename real_of<dtype>::type real;
+        std::vector<dtype> r, r0, p, v, s, t, p_hat, s_hat;
+
+        // out = diag_inv*in, or in if there's no preconditioner
+        static void precondition(const std::vector<dtype>& diag_inv,
+            const std::vector<dtype>& in, std::vector<dtype>& out) {
+            out.resize(in.size());
+            for(unsigned i = 0; i < in.size(); ++i) {
+                out[i] = diag_inv.empty() ? in[i] : diag_inv[i]*in[i];
+            }
+        }
+    public:
+        // Solves to a residual within rel_tol*|b|, starting from the guess
+        // in x, or throws a LinearSolveFailure. diag_inv is the inverse of
+        // the preconditioner diagonal, and may be empty.
+        // ApplyFn(const vector<dtype>& v, vector<dtype>& Av)
+        template<typename ApplyFn>
+        void solve(ApplyFn&& apply, const std::vector<dtype>& b,
+            std::vector<dtype>& x, const std::vector<dtype>& diag_inv,
+            double rel_tol, unsigned max_iter=100) {
+            const unsigned n = b.size();
+            const double target_sqr = rel_tol*rel_tol*real_dot(b, b);
+            apply(x, r);
+            for(unsigned i = 0; i < n; ++i) {
+                r[i] = b[i] - r[i];
+            }
+            if(real_dot(r, r) <= target_sqr) return;
+            r0 = r;
+            p.assign(n, 0);
+            v.assign(n, 0);
+            s.resize(n);
+            double rho = 1, alpha = 1, omega = 1;
+            for(unsigned iter = 0; iter < max_iter; ++iter) {
+                double rho_prev = rho;
+                rho = real_dot(r0, r);
+                if(rho == 0) break;
+                double beta = (rho/rho_prev)*(alpha/omega);
+                for(unsigned i = 0; i < n; ++i) {
+                    p[i] = r[i] + static_cast<real>(beta)
+                        *(p[i] - static_cast<real>(omega)*v[i]);
+                }
+                precondition(diag_inv, p, p_hat);
+                apply(p_hat, v);
+                double r0v = real_dot(r0, v);
+                if(r0v == 0) break;
+                alpha = rho/r0v;
+                axpy(s, r, -alpha, v);
+                if(real_dot(s, s) <= target_sqr) {
+                    axpy(x, alpha, p_hat);
+                    return;
+                }
+                precondition(diag_inv, s, s_hat);
+                apply(s_hat, t);
+                double tt = real_dot(t, t);
+                if(tt == 0) break;
+                omega = real_dot(t, s)/tt;
+                axpy(x, alpha, p_hat);
+                axpy(x, omega, s_hat);
+                axpy(r, s, -omega, t);
+                if(real_dot(r, r) <= target_sqr) return;
+                if(omega == 0) break;
+            }
+            throw LinearSolveFailure("Linear solve did not converge");
+        }
+};
+
+// Adaptive 2nd-order Rosenbrock scheme ROS2 (Verwer et al., SIAM J. Sci.
+// Comput. 20, 1999), which is L-stable and so suited to stiff problems,
+// with the Jacobian frozen at the start of each step. The error is estimated
+// against the embedded 1st-order solution.
+// Jacobian-vector products are matrix-free, either from differences of the
+// derivative, or from the derivative itself if it is linear in y (with no
+// inhomogeneous part). The linear systems are solved with BiCGSTAB, which is
+// preconditioned if there's a function for the Jacobian diagonal,
+// JacDiagFn(double t, vector<dtype>& diag).
+template<typename dtype>
+class Rosenbrock2 {
+    public:
+        typedef std::function<void(double, std::vector<dtype>&)> JacDiagFn;
+    private:
+        typedef typename real_of<dtype>::type real;
+
+        double tol;
+        double dt;
+        unsigned max_dt_adjusts;
+        StepControl control;
+        StepStats step_stats;
+        bool linear;
+        JacDiagFn jacobian_diagonal;
+
+        BiCGStab<dtype> solver;
+        std::vector<dtype> f0, f1, ft, k1, k2, rhs, y_shift, y_new, jv;
+        std::vector<dtype> diag, diag_inv;
+        double stiffness_ratio;
+    public:
+        Rosenbrock2(double tol, double dt=1e-3,
+            double dt_shrink=0.9, double dt_adjust_lim=4,
+            unsigned max_dt_adjusts=100, double pi_beta=0,
+            bool linear=false, JacDiagFn jacobian_diagonal=JacDiagFn())
+            :tol(tol), dt(dt), max_dt_adjusts(max_dt_adjusts),
+            control(dt_shrink, dt_adjust_lim, pi_beta, 0.5), linear(linear),
+            jacobian_diagonal(jacobian_diagonal),
+            stiffness_ratio(std::numeric_limits<double>::quiet_NaN()) {}
+
+        // Time step to try next
+        double get_dt() const {return dt;}
+        void set_dt(double dt) {this->dt = dt;}
+
+        const StepStats& stats() const {return step_stats;}
+
+        // Estimate of dt*|lambda| over the last accepted step, for the
+        // dominant Jacobian eigenvalue lambda, from the Jacobian applied to
+        // the derivative at the start of the step
+        double stiffness() const {return stiffness_ratio;}
+
+        template<typename DerivFn>
+        double step(double t, std::vector<dtype>& y, DerivFn&& deriv_fn) {
+            auto deriv = counted_deriv(deriv_fn, step_stats.deriv_evals);
+            const unsigned n = y.size();
+            const double gamma = 1 + 1/std::sqrt(2.);
+            deriv(t, y, f0);
+            if(jacobian_diagonal) {
+                jacobian_diagonal(t, diag);
+            }
+            const double y_norm = std::sqrt(real_dot(y, y));
+            const double eps_sqrt =
+                std::sqrt(std::numeric_limits<real>::epsilon());
+
+            // Time derivative of the derivative, from a difference
+            const double t_delta = eps_sqrt*std::max(1., std::abs(t));
+            deriv(t + t_delta, y, ft);
+            for(unsigned i = 0; i < n; ++i) {
+                ft[i] = (ft[i] - f0[i]) / static_cast<real>(t_delta);
+            }
+
+            // Jacobian at (t, y) applied to v
+            auto jacobian = [&](const std::vector<dtype>& v,
+                std::vector<dtype>& out) {
+                if(linear) {
+                    deriv(t, v, out);
+                    return;
+                }
+                double v_norm = std::sqrt(real_dot(v, v));
+                if(v_norm == 0) {
+                    out.assign(n, 0);
+                    return;
+                }
+                double delta = eps_sqrt*std::max(1., y_norm) / v_norm;
+                axpy(y_shift, y, delta, v);
+                deriv(t, y_shift, out);
+                for(unsigned i = 0; i < n; ++i) {
+                    out[i] = (out[i] - f0[i]) / static_cast<real>(delta);
+                }
+            };
+            // The linear systems only need to be accurate enough not to
+            // spoil the error estimate
+            const double lin_tol = std::min(1e-3, tol/10);
+
+            for(unsigned i = 0; i < max_dt_adjusts; ++i) {
+                // Time after the step
+                double t_new = t + dt;
+
+                // (1 - gamma*dt*J)*v
+                const double gdt = gamma*dt;
+                auto apply = [&](const std::vector<dtype>& v,
+                    std::vector<dtype>& out) {
+                    jacobian(v, jv);
+                    axpy(out, v, -gdt, jv);
+                };
+                diag_inv.resize(diag.size());
+                for(unsigned cmp = 0; cmp < diag.size(); ++cmp) {
+                    diag_inv[cmp] = static_cast<real>(1)
+                        / (static_cast<real>(1) - static_cast<real>(gdt)*diag[cmp]);
+                }
+
+                try {
+                    // Starting from the explicit Euler guesses
+                    axpy(rhs, f0, gdt, ft);
+                    k1 = rhs;
+                    solver.solve(apply, rhs, k1, diag_inv, lin_tol);
+                    axpy(y_shift, y, dt, k1);
+                    deriv(t_new, y_shift, f1);
+                    axpy(rhs, f1, -2, k1);
+                    axpy(rhs, -gdt, ft);
+                    k2 = rhs;
+                    solver.solve(apply, rhs, k2, diag_inv, lin_tol);
+                } catch(const LinearSolveFailure&) {
+                    // Take it as a failed step, expecting a smaller step to
+                    // be better conditioned
+                    dt /= 4;
+                    ++step_stats.rejected;
+                    continue;
+                }
+
+                // 2nd-order solution, and the maximum relative truncation
+                // error of any component
                 double error_ratio = 0;
-                for(unsigned cmp = 0; cmp < y_small.size(); ++cmp) {
+                y_new.resize(n);
+                for(unsigned cmp = 0; cmp < n; ++cmp) {
+                    y_new[cmp] = y[cmp] + static_cast<real>(1.5*dt)*k1[cmp]
+                        + static_cast<real>(0.5*dt)*k2[cmp];
+                    dtype err = static_cast<real>(0.5*dt)*(k1[cmp] + k2[cmp]);
                     // Buffer by the numeric double precision limit
                     double desired_err = tol *
-                        (std::abs(y_small[cmp]) + std::abs(y_big[cmp]))/2
+                        (std::abs(y_new[cmp]) + std::abs(y_new[cmp] - err))/2
                         + std::numeric_limits<double>::epsilon();
                     error_ratio = std::max(error_ratio,
-                        std::abs(y_small[cmp] - y_big[cmp]) / desired_err);
+                        std::abs(err) / desired_err);
                 }
 
                 // Estimate better time step
                 // This persists for the next time step if no more adjustments
                 // are needed
-                dt = std::max(dt / dt_adjust_lim,
-                    std::min(dt * dt_adjust_lim,
-                        dt * dt_shrink * pow(error_ratio, -0.2)
-                    ));
+                double dt_tried = dt;
+                dt = control.adjust(dt, error_ratio);
 
                 // Check if the error is within the desired tolerance
                 if(error_ratio < 1) {
-                    // Return the calculation with the smaller time step
-                    return std::make_pair(t_new, y_small);
+                    double f0_norm = std::sqrt(real_dot(f0, f0));
+                    stiffness_ratio = 0;
+                    if(f0_norm > 0) {
+                        jacobian(f0, jv);
+                        stiffness_ratio = dt_tried
+                            * std::sqrt(real_dot(jv, jv)) / f0_norm;
+                    }
+                    y.swap(y_new);
+                    step_stats.record(dt_tried);
+                    ++step_stats.implicit_steps;
+                    return t_new;
                 }
+                ++step_stats.rejected;
             }
 
             // Give up after too many adjustments
-            throw std::runtime_error(
-                "Maximum number of time step adjustments exceeded");
+            throw step_failure(t, dt);
+        }
+};
+
+// Dormand-Prince while the problem isn't stiff and Rosenbrock2 while it is,
+// going by the stiffness estimates of each, carrying over the time step on
+// a switch. As in Hairer's DOPRI5 code, switches after a number of steps
+// favouring the other scheme, with the count restarted after a run of steps
+// that don't, since Dormand-Prince limited by stability hovers around the
+// threshold. Also switches to Rosenbrock2 right away if Dormand-Prince fails
+template<typename dtype>
+class AutoStiffRK {
+    private:
+        // A bit below the Dormand-Prince stability boundary
+        const double stiff_threshold = 3.25;
+        const unsigned switch_votes = 15, restart_misses = 6;
+
+        DormandPrince<dtype> explicit_stepper;
+        Rosenbrock2<dtype> implicit_stepper;
+        bool stiff;
+        unsigned votes; // Steps favouring the other scheme
+        unsigned misses;    // Steps in a row that don't
+        unsigned long switches;
+
+        // Counts a step, returning whether to switch
+        bool vote(bool favours_switch) {
+            if(favours_switch) {
+                misses = 0;
+                return ++votes >= switch_votes;
+            }
+            if(++misses >= restart_misses) {
+                votes = 0;
+            }
+            return false;
+        }
+
+        void switch_scheme(double dt) {
+            stiff = !stiff;
+            votes = 0;
+            misses = 0;
+            ++switches;
+            if(stiff) {
+                implicit_stepper.set_dt(dt);
+            } else {
+                explicit_stepper.set_dt(dt);
+                explicit_stepper.reset();
+            }
+        }
+    public:
+        AutoStiffRK(double tol, double dt=1e-3,
+            double dt_shrink=0.9, double dt_adjust_lim=4,
+            unsigned max_dt_adjusts=100, double pi_beta=0,
+            bool linear=false, typename Rosenbrock2<dtype>::JacDiagFn
+                jacobian_diagonal=typename Rosenbrock2<dtype>::JacDiagFn())
+            :explicit_stepper(tol, dt, dt_shrink, dt_adjust_lim,
+                max_dt_adjusts, pi_beta),
+            implicit_stepper(tol, dt, dt_shrink, dt_adjust_lim,
+                max_dt_adjusts, pi_beta, linear, jacobian_diagonal),
+            stiff(false), votes(0), misses(0), switches(0) {}
+
+        // Whether the implicit scheme is in use
+        bool is_stiff() const {return stiff;}
+
+        StepStats stats() const {
+            StepStats total = explicit_stepper.stats();
+            total += implicit_stepper.stats();
+            total.switches = switches;
+            return total;
+        }
+
+        template<typename DerivFn>
+        double step(double t, std::vector<dtype>& y, DerivFn&& deriv) {
+            if(stiff) {
+                double t_new = implicit_stepper.step(t, y, deriv);
+                if(vote(implicit_stepper.stiffness() < stiff_threshold)) {
+                    switch_scheme(implicit_stepper.get_dt());
+                }
+                return t_new;
+            }
+            double t_new;
+            try {
+                t_new = explicit_stepper.step(t, y, deriv);
+            } catch(const std::runtime_error&) {
+                // y is untouched by a failed step
+                switch_scheme(explicit_stepper.get_dt());
+                return step(t, y, deriv);
+            }
+            if(vote(explicit_stepper.stiffness() > stiff_threshold)) {
+                switch_scheme(explicit_stepper.get_dt());
+            }
+            return t_new;
+        }
+};
+
+// Adaptive schemes that can be chosen at run time
+enum adaptive_scheme {step_doubling, dormand_prince, cash_karp,
+    lawson_dormand_prince, rosenbrock, auto_stiffness};
+
+// Scheme for a numeric code, as read from a config file: 0 (or nan) for
+// step doubling, 1 for Dormand-Prince, 2 for Cash-Karp, 3 for Lawson
+// Dormand-Prince, 4 for Rosenbrock and 5 for switching between
+// Dormand-Prince and Rosenbrock automatically
+inline adaptive_scheme to_adaptive_scheme(double code) {
+    if(code == 0 || std::isnan(code)) {
+        return step_doubling;
+    } else if(code == 1) {
+        return dormand_prince;
+    } else if(code == 2) {
+        return cash_karp;
+    } else if(code == 3) {
+        return lawson_dormand_prince;
+    } else if(code == 4) {
+        return rosenbrock;
+    } else if(code == 5) {
+        return auto_stiffness;
+    }
+    throw std::invalid_argument("Invalid adaptive stepper");
+}
+
+inline std::string adaptive_scheme_name(adaptive_scheme scheme) {
+    switch(scheme) {
+        case dormand_prince: return "Dormand-Prince 5(4)";
+        case cash_karp: return "Cash-Karp 5(4)";
+        case lawson_dormand_prince: return "Lawson Dormand-Prince 5(4)";
+        case rosenbrock: return "Rosenbrock ROS2";
+        case auto_stiffness:
+            return "Dormand-Prince 5(4) / Rosenbrock ROS2 by stiffness";
+        default: return "RK4 step doubling";
+    }
+}
+
+// Run time choice of adaptive stepper, and what the schemes need to know
+// about the problem beyond the derivative
+template<typename dtype>
+struct AdaptiveOptions {
+    adaptive_scheme scheme = step_doubling;
+    double tol = 1e-6;
+    double pi_beta = 0;    // PI control exponent (see StepControl)
+    // Diagonal linear part for the Lawson scheme (see LawsonRK)
+    std::vector<dtype> lin;
+    // For the Rosenbrock schemes (see Rosenbrock2): whether the derivative
+    // is linear in y, and the Jacobian diagonal as a preconditioner
+    bool linear = false;
+    typename Rosenbrock2<dtype>::JacDiagFn jacobian_diagonal;
+    // Parts of the loops over the components for the explicit schemes (see
+    // LoopParts). The Rosenbrock schemes run their loops on one thread
+    LoopParts loop_parts;
+};
+
+// Calls Fn(Stepper& stepper) with a new adaptive stepper as per some
+// options, returning the result
+template<typename dtype, typename Fn>
+auto with_adaptive_stepper(const AdaptiveOptions<dtype>& opts, Fn&& fn)
+    -> decltype(fn(std::declval<AdaptiveRK<dtype>&>())) {
+    const double dt = 1e-3, dt_shrink = 0.9, dt_adjust_lim = 4;
+    const unsigned max_dt_adjusts = 100;
+    switch(opts.scheme) {
+        case dormand_prince: {
+            DormandPrince<dtype> stepper(opts.tol, dt, dt_shrink,
+                dt_adjust_lim, max_dt_adjusts, opts.pi_beta, opts.loop_parts);
+            return fn(stepper);
+        }
+        case cash_karp: {
+            CashKarp<dtype> stepper(opts.tol, dt, dt_shrink, dt_adjust_lim,
+                max_dt_adjusts, opts.pi_beta, opts.loop_parts);
+            return fn(stepper);
+        }
+        case lawson_dormand_prince: {
+            LawsonDormandPrince<dtype> stepper(opts.lin, opts.tol, dt,
+                dt_shrink, dt_adjust_lim, max_dt_adjusts, opts.pi_beta,
+                opts.loop_parts);
+            return fn(stepper);
+        }
+        case rosenbrock: {
+            Rosenbrock2<dtype> stepper(opts.tol, dt, dt_shrink, dt_adjust_lim,
+                max_dt_adjusts, opts.pi_beta, opts.linear,
+                opts.jacobian_diagonal);
+            return fn(stepper);
+        }
+        case auto_stiffness: {
+            AutoStiffRK<dtype> stepper(opts.tol, dt, dt_shrink, dt_adjust_lim,
+                max_dt_adjusts, opts.pi_beta, opts.linear,
+                opts.jacobian_diagonal);
+            return fn(stepper);
+        }
+        default: {
+            AdaptiveRK<dtype> stepper(opts.tol, dt, dt_shrink, dt_adjust_lim,
+                max_dt_adjusts, opts.pi_beta, opts.loop_parts);
+            return fn(stepper);
+        }
+    }
+}
+
+}
+
+// ODE solver using some time-stepping scheme
+// Returns (time values, state values)
+// DerivFn(double t, vector<dtype> y) -> vector<dtype> dy
+// Timestepper(double t, vector<dtype> y, DerivFn deriv) -> (new_t, new_y)
+template<typename dtype, typename DerivFn, typename Timestepper>
+std::vector<std::pair<double, std::vector<dtype>>> odesolve(
+    DerivFn deriv, const std::vector<dtype>& y0, double t_final,
+    Timestepper step) {
+
+    std::vector<std::pair<double, std::vector<dtype>>>
+        odesolution{{0, y0}};
+    while(odesolution.back().first < t_final) {
+        try {
+            odesolution.push_back(step(
+                odesolution.back().first, odesolution.back().second, deriv));
+        } catch(const std::exception &e) {
+            std::cout << e.what() << std::endl;
+            break;
+        }
+    }
+    return odesolution;
+}
+
+// Supporting function
+// c1*v1 + c2*v2
+template<typename dtype>
+std::vector<dtype> vlincombo(const std::vector<dtype>& v1,
+    const std::vector<dtype>& v2, dtype c1=1, dtype c2=1) {
+    std::vector<dtype> vsum;
+    vsum.reserve(v1.size());
+    for(unsigned i = 0; i < v1.size(); ++i) {
+        vsum.push_back(c1*v1[i] + c2*v2[i]);
+    }
+    return vsum;
+}
+
+// The steppers below take and return whole states, and derivatives of the
+// form DerivFn(double t, vector<dtype> y) -> vector<dtype> dy. They are thin
+// adapters over the in-place steppers above, which should be preferred for
+// large states.
+
+// 2nd-order Runge-Kutta scheme
+class RK2 {
+    private:
+        double dt;
+    public:
+        RK2(double dt):dt(dt) {}
+
+        template<typename dtype, typename DerivFn>
+        std::pair<double, std::vector<dtype>> operator()(
+            double t, const std::vector<dtype>& y, DerivFn deriv) {
+            std::vector<dtype> y_new(y);
+            double t_new = inplace::RK2<dtype>(dt).step(t, y_new,
+                inplace::value_deriv(deriv));
+            return std::make_pair(t_new, y_new);
+        }
+};
+
+// 4th-order Runge-Kutta scheme
+class RK4 {
+    private:
+        double dt;
+    public:
+        RK4(double dt):dt(dt) {}
+
+        void set_dt(double dt) {
+            this->dt = dt;
+        }
+
+        template<typename dtype, typename DerivFn>
+        std::pair<double, std::vector<dtype>> operator()(
+            double t, const std::vector<dtype>& y, DerivFn deriv) {
+            std::vector<dtype> y_new(y);
+            double t_new = inplace::RK4<dtype>(dt).step(t, y_new,
+                inplace::value_deriv(deriv));
+            return std::make_pair(t_new, y_new);
+        }
+};
+
+// Adaptive 4/5-th order Runge-Kutta scheme
+class AdaptiveRK {
+    private:
+        double tol;
+        double dt;
+        double dt_shrink;   // Shrink factor on time step adjustment
+        double dt_adjust_lim;   // Max factor of adjustment in a single iteration
+        unsigned max_dt_adjusts;
+    public:
+        AdaptiveRK(double tol, double dt=1e-3,
+            double dt_shrink=0.9, double dt_adjust_lim=4,
+            unsigned max_dt_adjusts=100)
+            :tol(tol), dt(dt),
+            dt_shrink(dt_shrink), dt_adjust_lim(dt_adjust_lim),
+            max_dt_adjusts(max_dt_adjusts) {}
+
+        template<typename dtype, typename DerivFn>
+        std::pair<double, std::vector<dtype>> operator()(
+            double t, const std::vector<dtype>& y, DerivFn deriv) {
+            inplace::AdaptiveRK<dtype> stepper(tol, dt, dt_shrink,
+                dt_adjust_lim, max_dt_adjusts);
+            std::vector<dtype> y_new(y);
+            double t_new = stepper.step(t, y_new, inplace::value_deriv(deriv));
+            // Carry the adjusted time step over to the next call
+            dt = stepper.get_dt();
+            return std::make_pair(t_new, y_new);
         }
 };
 
@@ -3,11 +3,12 @@
 Generate a heatmap plot from data in tall ordered format.
 """
 import numpy as np
+from load_data import load_data
 import matplotlib.pyplot as plt
 from matplotlib import cm
 
 ######## CONFIGURATION ########
-# numpy.loadtxt() stuff
+# numpy.loadtxt() stuff, also applied to .npy files
 fname = 'output/*/*.out'
 skiprows = 0
 usecols = None  # Can only use three columns at a time
@@ -15,7 +16,7 @@ usecols = None  # Can only use three columns at a time
 cmap = cm.jet
 ######## END CONFIGURATION ########
 
-data = np.loadtxt(fname, skiprows=skiprows, usecols=usecols)
+data = load_data(fname, skiprows=skiprows, usecols=usecols)
 
 # Convert from tall format to meshgrid format
 y = np.unique(data[:, 1])
@@ -4,9 +4,10 @@ Generate a 1D histogram from data
 """
 
 import numpy as np
+from load_data import load_data
 import matplotlib.pyplot as plt
 
 fname = 'output/*/*.out'
-data = np.loadtxt(fname)
+data = load_data(fname)
 plt.hist(data, bins=100, density=True)
 plt.show()
@@ -0,0 +1,37 @@
+#!/usr/bin/env python3
+"""
+Load simulation output written either as text (.out) or as NumPy binary
+(.npy), with the same interface as numpy.loadtxt().
+
+Usable as a module (from load_data import load_data), or from the command
+line to print a summary of a file.
+"""
+import sys
+import numpy as np
+
+
+def load_data(fname, skiprows=0, usecols=None):
+    """Load a data file, choosing the reader by file extension.
+
+    For .npy files, skiprows drops leading rows and usecols selects columns,
+    matching what numpy.loadtxt() would do with the text version of the file.
+    .npy files are memory-mapped, so only the parts that are used get read.
+    """
+    if not fname.endswith('.npy'):
+        return np.loadtxt(fname, skiprows=skiprows, usecols=usecols)
+
+    data = np.load(fname, mmap_mode='r')
+    if data.ndim == 1:
+        data = data[skiprows:]
+    else:
+        data = data[skiprows:, :]
+        if usecols is not None:
+            data = data[:, usecols]
+    return np.array(data)
+
+
+if __name__ == '__main__':
+    for fname in sys.argv[1:]:
+        data = load_data(fname)
+        print('{}: shape {}, min {}, max {}'.format(
+            fname, data.shape, data.min(), data.max()))
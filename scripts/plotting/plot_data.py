@@ -3,10 +3,11 @@
 Generate multiple 1D plots from data
 """
 import numpy as np
+from load_data import load_data
 import matplotlib.pyplot as plt
 
 ######## CONFIGURATION ########
-# numpy.loadtxt() stuff
+# numpy.loadtxt() stuff, also applied to .npy files
 fname = 'output/*/*.out'
 skiprows = 0
 usecols = None
@@ -23,7 +24,7 @@ plot_options = []
 n_yticks = 2
 ######## END CONFIGURATION ########
 
-data = np.loadtxt(fname, skiprows=skiprows, usecols=usecols)
+data = load_data(fname, skiprows=skiprows, usecols=usecols)
 # assume data points are stratified across the larger dimension
 try:
     if data.shape[0] < data.shape[1]:
@@ -23,6 +23,10 @@ std::string tag_filename(std::string filename,
     return tagged;
 }
 
+std::string replace_extension(std::string filename, std::string extension) {
+    return filename.substr(0, filename.rfind(".")) + extension;
+}
+
 std::string fullfile(std::string filename, std::string dir) {
     return dir + "/" + filename;
 }
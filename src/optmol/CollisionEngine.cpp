@@ -0,0 +1,68 @@
+#include "CollisionEngine.hpp"
+
+unsigned long CollisionEngine::step(ParticleEnsemble& particles,
+    const PhysicalParams& params, double avgKE, ThreadPool& pool,
+    std::vector< RandProcesses<pcg32> >& rngs) {
+    // Constant over the whole step: P = prob_coeff/(relative speed)^3
+    const double prob_coeff = params.scatter_coeff
+        * PhysicalParams::calc_coulomb_log(avgKE, params.particle_density)
+        * params.dt;
+    const double prob_coeff_sqr = sqr(prob_coeff);
+    // Floor on the relative speed, as the 6th power, relative to the RMS
+    // relative speed sqrt(2*<v^2>) = sqrt(4*avgKE/mass)
+    const double floor_speed_6 = cube(sqr(params.collision_speed_floor)
+        * 4*avgKE/params.mass);
+    // P at the floor bounds P for every pair
+    prob_majorant = floor_speed_6 > prob_coeff_sqr ?
+        prob_coeff/sqrt(floor_speed_6) : 1;
+    const double majorant = test_all_pairs ? 1 : prob_majorant;
+
+    // Number of candidate pairs to test, rounded stochastically to keep the
+    // expected number of collisions unbiased
+    double n_candidates_exact = params.collisions_per_step*majorant;
+    unsigned n_candidates = static_cast<unsigned>(n_candidates_exact);
+    if(rngs[0].rand_uniform() < n_candidates_exact - n_candidates) {
+        ++n_candidates;
+    }
+    n_candidates = std::min(n_candidates, params.collisions_per_step);
+
+    // Choose the candidate pairs with a partial Fisher-Yates shuffle
+    for(unsigned i = 0; i < 2*n_candidates; ++i) {
+        std::swap(perm[i],
+            perm[i + rngs[0].rand_index(perm.size() - i)]);
+    }
+
+    std::vector<unsigned long> n_collisions(pool.size(), 0);
+    pool.run([&](unsigned tid) {
+        RandProcesses<pcg32>& rng = rngs[tid];
+        unsigned begin, end;
+        std::tie(begin, end) = pool.chunk(n_candidates, tid);
+        unsigned long n_coll = 0;
+        for(unsigned k = begin; k < end; ++k) {
+            unsigned idx1 = perm[2*k], idx2 = perm[2*k + 1];
+            // Work with the cube of the squared relative speed, so that a
+            // rejected pair costs no square roots or divisions:
+            // u*M < P  <=>  (u*M)^2 * (rel speed)^6 < prob_coeff^2
+            // This also caps P at 1, since then M = 1 and u < 1
+            double rel_speed_6 = std::max(floor_speed_6,
+                cube(particles.rel_speed_sqr(idx1, idx2)));
+            if(rel_speed_6*sqr(rng.rand_uniform()*majorant)
+                >= prob_coeff_sqr) {
+                continue;
+            }
+            ++n_coll;
+
+            // Carry on with scattering the pair
+            // Get a random direction for scattering
+            double cos_theta, phi;
+            std::tie(cos_theta, phi) = rng.rand_dir();
+            double sin_theta = sqrt(1 - sqr(cos_theta));
+
+            particles.scatter(idx1, idx2,
+                sin_theta*cos(phi), sin_theta*sin(phi), cos_theta);
+        }
+        n_collisions[tid] = n_coll;
+    });
+
+    return std::accumulate(n_collisions.begin(), n_collisions.end(), 0ul);
+}
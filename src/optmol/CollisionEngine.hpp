@@ -0,0 +1,67 @@
+// Binary Coulomb collisions between disjoint random pairs of particles
+#ifndef COLLISIONENGINE_HPP_
+#define COLLISIONENGINE_HPP_
+
+#include <cmath>
+#include <vector>
+#include <numeric>
+#include <algorithm>
+#include <iostream>
+#include "binio.hpp"
+#include "PhysicalParams.hpp"
+#include "ParticleEnsemble.hpp"
+#include "RandProcesses.hpp"
+#include "lasercool/threadpool.hpp"
+#include "pcg_random.hpp"
+#include "mathutil.hpp"
+
+// Every time step, the particles are notionally split into N/2 disjoint
+// candidate pairs, each of which collides with probability
+// P = coeff*(coulomb log)*dt/(relative speed)^3 (capped at 1).
+//
+// Rather than testing all of them, a majorant M >= P over all pairs is
+// taken, about M*N/2 pairs are tested, and each one collides with probability
+// P/M (no-time-counter scheme). The expected number of collisions is the
+// same, but when collisions are rare most pairs are never looked at.
+// P grows without bound as the relative speed goes to 0, so the only
+// majorant that holds for every pair is 1, unless P is evaluated at no less
+// than a floor on the relative speed, params.collision_speed_floor times the
+// RMS relative speed. M is then P at the floor, and is recomputed on every
+// step as the temperature changes. Without a floor, every pair is tested.
+//
+// The pairs are disjoint, so they can be processed in parallel.
+class CollisionEngine {
+    private:
+        // Partially shuffled particle indexes. Entries 2k and 2k+1 form the
+        // k-th candidate pair
+        std::vector<unsigned> perm;
+        // Test every pair, whatever the majorant, for checking the
+        // no-time-counter scheme against
+        bool test_all_pairs;
+        double prob_majorant;
+    public:
+        CollisionEngine(unsigned n_particles=0, bool test_all_pairs=false):
+            perm(n_particles), test_all_pairs(test_all_pairs),
+            prob_majorant(1) {
+            std::iota(perm.begin(), perm.end(), 0);
+        }
+
+        // Majorant of the latest step
+        double majorant() const {return prob_majorant;}
+
+        // Binary checkpointing of the pairing state
+        void save(std::ostream& out) const {
+            write_binary(out, perm);
+        }
+        void load(std::istream& in) {
+            read_binary(in, perm);
+        }
+
+        // Run collisions over one time step, given the current average
+        // kinetic energy. Thread t of the pool draws from rngs[t], and
+        // rngs[0] also chooses the pairs. Returns the number of collisions
+        unsigned long step(ParticleEnsemble&, const PhysicalParams&, double,
+            ThreadPool&, std::vector< RandProcesses<pcg32> >&);
+};
+
+#endif
@@ -0,0 +1,553 @@
+#include "MolassesSimulation.hpp"
+
+const std::string ENERGY_OUTFILEBASE = "avgKE.out";
+const std::string SPEED_DISTR_OUTFILEBASE = "speed_distr.out";
+const std::string AXIS_TEMPS_OUTFILEBASE = "axis_temps.out";
+const std::string SPEED_HIST_OUTFILEBASE = "speed_hist.out";
+const std::string CHECKPOINT_OUTFILEBASE = "checkpoint.bin";
+// Identifies checkpoint files and their layout version
+const char CHECKPOINT_MAGIC[8] = {'O', 'P', 'T', 'M', 'O', 'L', 'C', '3'};
+const unsigned OUTFILENAME_PRECISION = 3;
+
+const unsigned PhotonBuffers::block_size;
+
+MolassesSimulation::MolassesSimulation(const PhysicalParams& params):
+    params(params),
+    pool(std::max(1u, std::min(params.n_threads, params.n_particles))),
+    particles(params.n_particles), photon_buffers(pool.size()),
+    counts(pool.size(), EventCounts{0, 0}),
+    collisions((params.n_particles > 1 && params.scatter_coeff > 0) ?
+        params.n_particles : 0),
+    step(0), n_collisions(0),
+    observables(params.mass, params.n_particles, pool.size(),
+        params.n_histogram_bins) {
+    // Thermal velocity standard deviation of velocity components is sqrt(kT/m)
+    double thermal_v_stddev = sqrt(
+        fundamental_constants::K_BOLTZMANN*params.initial_temp/params.mass);
+
+    // Set up RNGs. Every thread draws from its own stream of the same seed,
+    // and thread 0's stream also drives the serial parts of the simulation
+    rngs.reserve(pool.size());
+    for(unsigned t = 0; t < pool.size(); ++t) {
+        pcg32 generator(params.seed);
+        generator.set_stream(t);
+        rngs.emplace_back(generator, thermal_v_stddev, params.n_particles);
+    }
+
+    // Initialize velocities to thermal distribution
+    for(unsigned c = 0; c < 3; ++c) {
+        rngs[0].fill_thermal_velocity(particles.component(c),
+            params.n_particles);
+    }
+    /// For output consistency with a single particle, force to have exactly
+    /// the thermal energy
+    if(params.n_particles == 1) {
+        for(unsigned c = 0; c < 3; ++c) {
+            particles.v[c].back() = thermal_v_stddev;
+        }
+    }
+    ///
+
+    if(params.absorption_engine == PhysicalParams::event_driven_engine) {
+        t_next.resize(params.n_particles);
+        pool.run([&](unsigned tid) {
+            unsigned begin, end;
+            std::tie(begin, end) = pool.chunk(params.n_particles, tid);
+            for(unsigned p = begin; p < end; ++p) {
+                t_next[p] = rngs[tid].rand_waiting_time(
+                    PhysicalParams::n_lasers*params.max_absorb_rate);
+            }
+        });
+    }
+}
+
+std::string MolassesSimulation::filename_suffix() const {
+    std::ostringstream suffix_ss;
+    suffix_ss << std::setprecision(OUTFILENAME_PRECISION)
+        << "N" << params.n_particles
+        << "_Density" << params.particle_density
+        << "_Omega" << params.rabi_freq_per_decay_rate
+        << "_Delta" << params.initial_detuning_per_decay_rate << "to"
+        << params.final_detuning_per_decay_rate
+        << "_RampRate" << params.detuning_ramp_rate_natl_units
+        << "_Temp" << params.initial_temp;
+    return suffix_ss.str();
+}
+
+void MolassesSimulation::save_checkpoint(std::string fname) const {
+    // Write to a temporary file first, so that an interruption while
+    // writing can't destroy the previous checkpoint
+    std::string tmp_fname = fname + ".tmp";
+    std::ofstream out(tmp_fname, std::ios::binary | std::ios::trunc);
+    out.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    // Things that have to match when resuming
+    write_binary(out, params.n_particles);
+    write_binary(out, pool.size());
+    write_binary(out, params.absorption_engine);
+    write_binary(out, params.dt);
+
+    write_binary(out, step);
+    for(const auto& vc: particles.v) {
+        write_binary(out, vc);
+    }
+    for(const auto& rng: rngs) {
+        write_binary(out, rng.state());
+    }
+    for(const auto& c: counts) {
+        write_binary(out, c);
+    }
+    write_binary(out, n_collisions);
+    write_binary(out, t_next);
+    collisions.save(out);
+    observables.save(out);
+    out.close();
+    if(!out || std::rename(tmp_fname.c_str(), fname.c_str()) != 0) {
+        throw std::runtime_error("Could not write checkpoint file " + fname);
+    }
+}
+
+void MolassesSimulation::load_checkpoint(std::string fname) {
+    std::ifstream in(fname, std::ios::binary);
+    if(!in) {
+        throw std::runtime_error("Could not open checkpoint file " + fname);
+    }
+    char magic[sizeof(CHECKPOINT_MAGIC)];
+    if(!in.read(magic, sizeof(magic))
+        || !std::equal(magic, magic + sizeof(magic), CHECKPOINT_MAGIC)) {
+        throw std::runtime_error(fname + " is not a checkpoint file");
+    }
+    unsigned n_particles, n_threads;
+    PhysicalParams::absorption_engine_type absorption_engine;
+    double dt;
+    read_binary(in, n_particles);
+    read_binary(in, n_threads);
+    read_binary(in, absorption_engine);
+    read_binary(in, dt);
+    if(n_particles != params.n_particles || n_threads != pool.size()
+        || absorption_engine != params.absorption_engine || dt != params.dt) {
+        throw std::runtime_error("Checkpoint file " + fname
+            + " has a different number of particles, threads, absorption"
+            " engine, or time step");
+    }
+
+    read_binary(in, step);
+    for(auto& vc: particles.v) {
+        read_binary(in, vc);
+    }
+    for(auto& rng: rngs) {
+        std::string state;
+        read_binary(in, state);
+        rng.set_state(state);
+    }
+    for(auto& c: counts) {
+        read_binary(in, c);
+    }
+    read_binary(in, n_collisions);
+    read_binary(in, t_next);
+    collisions.load(in);
+    observables.load(in);
+}
+
+SimResults MolassesSimulation::run(std::string output_dir) {
+    bool write_files = !output_dir.empty();
+    // Output files are either text or .npy
+    std::string out_ext = params.binary_output ? ".npy" : ".out";
+    std::string suffix = filename_suffix();
+    std::unique_ptr<TableWriter> energy_outfile, axis_temps_outfile,
+        speed_hist_outfile;
+    if(write_files) {
+        auto outfile_name = [&](std::string base) {
+            return fullfile(tag_filename(replace_extension(base, out_ext),
+                suffix, params.particle_species), output_dir);
+        };
+        energy_outfile = make_table_writer(outfile_name(ENERGY_OUTFILEBASE),
+            2, params.binary_output);
+        axis_temps_outfile = make_table_writer(
+            outfile_name(AXIS_TEMPS_OUTFILEBASE), 4, params.binary_output);
+        if(observables.hist_bins() > 0) {
+            speed_hist_outfile = make_table_writer(
+                outfile_name(SPEED_HIST_OUTFILEBASE),
+                2 + observables.hist_bins(), params.binary_output);
+        }
+    }
+    std::string checkpoint_file = fullfile(tag_filename(
+        CHECKPOINT_OUTFILEBASE, suffix, params.particle_species), output_dir);
+    bool checkpointing = write_files && params.steps_between_checkpoints > 0;
+    // Write out the given snapshot
+    auto write_snapshot = [&](unsigned s) {
+        if(!write_files) return;
+        double t = observables.times[s];
+        energy_outfile->write_row({t,
+            observables.avg_KEs[s]/fundamental_constants::K_BOLTZMANN});
+        axis_temps_outfile->write_row({t, observables.axis_temps[3*s],
+            observables.axis_temps[3*s + 1], observables.axis_temps[3*s + 2]});
+        if(speed_hist_outfile) {
+            unsigned row_len = 1 + observables.hist_bins();
+            speed_hist_outfile->write(&t, 1);
+            speed_hist_outfile->write(&observables.histograms[s*row_len],
+                row_len);
+        }
+    };
+    auto take_snapshot = [&](double t) {
+        observables.take_snapshot(t, particles, pool);
+        write_snapshot(observables.n_snapshots() - 1);
+    };
+    if(observables.n_snapshots() == 0) {
+        // Initial observables
+        take_snapshot(0);
+
+        // Initial speed distribution
+        if(write_files) {
+            write_speed_distr(fullfile(tag_filename(
+                replace_extension(SPEED_DISTR_OUTFILEBASE, out_ext),
+                {"initial", suffix}, params.particle_species),
+                output_dir
+            ), particles, params.binary_output);
+        }
+    } else {
+        // Resuming from a checkpoint, so rewrite the snapshots up to it
+        for(unsigned s = 0; s < observables.n_snapshots(); ++s) {
+            write_snapshot(s);
+        }
+    }
+
+    /// TIMING
+    auto start = std::chrono::system_clock::now();
+    ///
+
+    bool event_driven =
+        (params.absorption_engine == PhysicalParams::event_driven_engine);
+    bool has_collisions = params.n_particles > 1 && params.scatter_coeff > 0;
+    // Collisions happen once per time step, but without them the
+    // event-driven engine only has to stop at the snapshots
+    unsigned steps_per_sync = (event_driven && !has_collisions) ?
+        params.steps_between_snapshots : 1;
+
+    // Run over each time step
+    while(step < params.n_time_steps) {
+        unsigned i = step;
+        unsigned i_next = std::min(i + steps_per_sync, params.n_time_steps);
+
+        // Photon events are independent between particles, so each thread
+        // handles its own contiguous block of them
+        if(event_driven) {
+            double t_end = i_next*params.dt;
+            pool.run([&](unsigned tid) {
+                unsigned begin, end;
+                std::tie(begin, end) = pool.chunk(params.n_particles, tid);
+                absorb_emit_events(particles, begin, end, params, t_end,
+                    t_next.data(), rngs[tid], counts[tid],
+                    observables.delta(tid));
+            });
+        } else {
+            // Ramped detuning and photon wavenumber
+            double detuning = calc_ramp(i_next*params.dt,
+                params.initial_detuning, params.final_detuning,
+                params.detuning_ramp_rate);
+            double laser_wavenumber = PhysicalParams::calc_laser_wavenumber(
+                params.resonant_wavenumber, detuning);
+            pool.run([&](unsigned tid) {
+                unsigned begin, end;
+                std::tie(begin, end) = pool.chunk(params.n_particles, tid);
+                absorb_emit(particles, begin, end, params, detuning,
+                    laser_wavenumber, rngs[tid], photon_buffers[tid],
+                    counts[tid], observables.delta(tid));
+            });
+        }
+        // Insert the desired measurement calculations //
+        // Note that scattering particles conserves kinetic energy,
+        // so the average doesn't have to be updated later
+        if(i_next % params.steps_between_snapshots == 0) {
+            take_snapshot(i_next*params.dt);
+        } else {
+            observables.collect();
+        }
+        double avgKE = observables.avg_kinetic_energy();
+
+        // Scatter some number of particles if possible
+        if(has_collisions) {
+            n_collisions += collisions.step(particles, params, avgKE,
+                pool, rngs);
+        }
+
+        step = i_next;
+        if(checkpointing && step < params.n_time_steps
+            && i_next/params.steps_between_checkpoints
+                > i/params.steps_between_checkpoints) {
+            save_checkpoint(checkpoint_file);
+        }
+    }
+    // A checkpoint of the finished run allows it to be extended later
+    if(checkpointing) {
+        save_checkpoint(checkpoint_file);
+    }
+    double final_KE = particles.avg_kinetic_energy(params.mass);
+    if(write_files) {
+        energy_outfile->close();
+        // Final speed distribution
+        write_speed_distr(fullfile(tag_filename(
+            replace_extension(SPEED_DISTR_OUTFILEBASE, out_ext),
+            {"final", suffix}, params.particle_species),
+            output_dir
+        ), particles, params.binary_output);
+    }
+
+    ///
+    std::chrono::duration<double> total_seconds =
+        std::chrono::system_clock::now() - start;
+    ///
+
+    SimResults results;
+    auto KE_to_temp = [](double avgKE) {
+        return 2*avgKE/(3*fundamental_constants::K_BOLTZMANN);
+    };
+    const std::vector<double>& snapshot_KEs = observables.avg_KEs;
+    results.initial_temp = KE_to_temp(snapshot_KEs.front());
+    results.final_temp = KE_to_temp(final_KE);
+    // 1/e relaxation time, from the first snapshot that gets there
+    double threshold = std::abs(snapshot_KEs.front() - final_KE)/M_E;
+    results.cooling_time = NAN;
+    for(unsigned s = 0; s < snapshot_KEs.size(); ++s) {
+        if(std::abs(snapshot_KEs[s] - final_KE) <= threshold) {
+            results.cooling_time = observables.times[s];
+            break;
+        }
+    }
+    results.n_heat = results.n_cool = 0;
+    for(auto c: counts) {
+        results.n_heat += c.n_heat;
+        results.n_cool += c.n_cool;
+    }
+    results.n_collisions = n_collisions;
+    results.runtime = total_seconds.count();
+    return results;
+}
+
+void absorb_emit(ParticleEnsemble& particles, unsigned begin, unsigned end,
+    const PhysicalParams& params, double detuning, double laser_wavenumber,
+    RandProcesses<pcg32>& rng, PhotonBuffers& buf, EventCounts& counts,
+    double& delta_v_sqr) {
+    // Loop invariants, held locally so the compiler knows they can't alias
+    // the per-particle arrays
+    const double decay_rate = params.decay_rate, rabi_freq = params.rabi_freq,
+        dt = params.dt;
+    const bool fast = params.fast_kernel;
+    const AbsorbRateCoeffs coeffs(decay_rate, rabi_freq);
+    const double numer_dt = coeffs.numer*dt, offset = coeffs.offset;
+    // velocity kick from a single photon absorption/emission
+    const double v_kick = fundamental_constants::HBAR*laser_wavenumber
+        / params.mass;
+    double *absorb_prob = buf.absorb_prob.data(), *rand_u = buf.rand_u.data();
+    unsigned* events = buf.events.data();
+    unsigned long n_heat = 0, n_cool = 0;
+    double d_v_sqr = 0;
+
+    // Work through cache-sized blocks of particles
+    for(unsigned block = begin; block < end;
+        block += PhotonBuffers::block_size) {
+        unsigned len = std::min(PhotonBuffers::block_size, end - block);
+
+        // Iterate over each of the 6 lasers
+        // Goes through -x, +x, -y, +y, -z, +z
+        for(unsigned j = 0; j < PhysicalParams::n_lasers; ++j) {
+            unsigned component = j / 2;
+            int direction = (j % 2) ? 1 : -1;
+            double* vc = particles.component(component) + block;
+
+            double doppler_coeff = direction*laser_wavenumber;
+            unsigned n_events = 0;
+            if(fast) {
+                // With q = (absorption rate)*dt = numer*dt/D, where
+                // D = (Doppler-shifted detuning)^2 + offset > 0, the test
+                // u < q - q^2/2 is multiplied through by D^2 to get rid of
+                // the division. A positive margin means an absorption
+                rng.fill_uniform_fast(rand_u, len);
+                double* margin = absorb_prob;
+                for(unsigned p = 0; p < len; ++p) {
+                    double D = sqr(detuning - doppler_coeff*vc[p]) + offset;
+                    margin[p] = numer_dt*(D - 0.5*numer_dt) - rand_u[p]*D*D;
+                }
+                for(unsigned p = 0; p < len; ++p) {
+                    events[n_events] = p;
+                    n_events += (margin[p] > 0);
+                }
+            } else {
+                // Photon absorption probability for every particle, from the
+                // Doppler-shifted detuning. Kept free of branches and RNG
+                // calls so that it vectorizes
+                for(unsigned p = 0; p < len; ++p) {
+                    double absorb_rate = PhysicalParams::calc_absorb_rate(
+                        decay_rate, rabi_freq, detuning - doppler_coeff*vc[p]);
+                    absorb_prob[p] = absorb_rate*dt - sqr(absorb_rate*dt)/2;
+                }
+
+                // Decide whether or not each particle absorbs a photon, and
+                // gather the ones that do
+                rng.fill_uniform(rand_u, len);
+                for(unsigned p = 0; p < len; ++p) {
+                    events[n_events] = p;
+                    n_events += (rand_u[p] < absorb_prob[p]);
+                }
+            }
+            if(n_events == 0) continue;
+
+            // Random directions for emission
+            if(fast) {
+                rng.fill_dir_marsaglia(buf.dir[0].data(), buf.dir[1].data(),
+                    buf.dir[2].data(), n_events);
+            } else {
+                rng.fill_dir(buf.dir[0].data(), buf.dir[1].data(),
+                    buf.dir[2].data(), n_events);
+            }
+
+            for(unsigned e = 0; e < n_events; ++e) {
+                unsigned p = events[e];
+                double v_sqr_before = particles.speed_sqr(block + p);
+                if(vc[p]*direction > 0) {
+                    n_heat++;
+                } else {
+                    n_cool++;
+                }
+
+                // Photon absorbed //
+                // Absorption kick
+                particles.kick(block + p, component, direction*v_kick);
+                // Emission kick
+                particles.kick(block + p, v_kick*buf.dir[0][e],
+                    v_kick*buf.dir[1][e], v_kick*buf.dir[2][e]);
+                d_v_sqr += particles.speed_sqr(block + p) - v_sqr_before;
+            }
+        }
+    }
+    counts.n_heat += n_heat;
+    counts.n_cool += n_cool;
+    delta_v_sqr += d_v_sqr;
+}
+
+void absorb_emit_events(ParticleEnsemble& particles,
+    unsigned begin, unsigned end, const PhysicalParams& params, double t_end,
+    double* t_next, RandProcesses<pcg32>& rng, EventCounts& counts,
+    double& delta_v_sqr) {
+    const double decay_rate = params.decay_rate, rabi_freq = params.rabi_freq;
+    // No single laser can drive absorption faster than on resonance, so
+    // this bounds the total absorption rate at all times and velocities
+    const double rate_bound = PhysicalParams::n_lasers*params.max_absorb_rate;
+    const bool fast = params.fast_kernel;
+    const AbsorbRateCoeffs coeffs(decay_rate, rabi_freq);
+    unsigned long n_heat = 0, n_cool = 0;
+    double d_v_sqr = 0;
+    // Denominators of the laser absorption rates, for the fast kernel
+    double D[PhysicalParams::n_lasers];
+
+    for(unsigned p = begin; p < end; ++p) {
+        double t = t_next[p];
+        while(t < t_end) {
+            // Ramped detuning and photon wavenumber at the candidate time
+            double detuning = calc_ramp(t, params.initial_detuning,
+                params.final_detuning, params.detuning_ramp_rate);
+            double laser_wavenumber = PhysicalParams::calc_laser_wavenumber(
+                params.resonant_wavenumber, detuning);
+
+            // Thinning: the candidate is an absorption from laser j with
+            // probability (rate of laser j)/(rate bound), and is discarded
+            // otherwise
+            double threshold = (fast ? rng.rand_uniform_fast() :
+                rng.rand_uniform())*rate_bound;
+            if(fast) {
+                // Most candidates are discarded, so check that first without
+                // any divisions. The total rate is
+                // sum_j numer/D_j = numer*(sum_j prod_{i != j} D_i)/prod_i D_i
+                for(unsigned j = 0; j < PhysicalParams::n_lasers; ++j) {
+                    int direction = (j % 2) ? 1 : -1;
+                    D[j] = sqr(detuning - direction*laser_wavenumber
+                        * particles.v[j / 2][p]) + coeffs.offset;
+                }
+                double prefix[PhysicalParams::n_lasers + 1];
+                prefix[0] = 1;
+                for(unsigned j = 0; j < PhysicalParams::n_lasers; ++j) {
+                    prefix[j + 1] = prefix[j]*D[j];
+                }
+                double suffix = 1, sum_of_products = 0;
+                for(unsigned j = PhysicalParams::n_lasers; j-- > 0; ) {
+                    sum_of_products += prefix[j]*suffix;
+                    suffix *= D[j];
+                }
+                if(threshold*suffix >= coeffs.numer*sum_of_products) {
+                    t += rng.rand_waiting_time_fast(rate_bound);
+                    continue;
+                }
+            }
+            // Goes through -x, +x, -y, +y, -z, +z
+            for(unsigned j = 0; j < PhysicalParams::n_lasers; ++j) {
+                unsigned component = j / 2;
+                int direction = (j % 2) ? 1 : -1;
+                double vc = particles.v[component][p];
+                threshold -= fast ? coeffs.numer/D[j] :
+                    PhysicalParams::calc_absorb_rate(decay_rate, rabi_freq,
+                        detuning - direction*laser_wavenumber*vc);
+                if(threshold >= 0) {
+                    continue;
+                }
+
+                if(vc*direction > 0) {
+                    n_heat++;
+                } else {
+                    n_cool++;
+                }
+
+                // Photon absorbed //
+                double v_sqr_before = particles.speed_sqr(p);
+                double v_kick = fundamental_constants::HBAR*laser_wavenumber
+                    / params.mass;
+                // Absorption kick
+                particles.kick(p, component, direction*v_kick);
+                // Get a random direction for emission
+                double dir_x, dir_y, dir_z;
+                if(fast) {
+                    rng.rand_dir_cartesian(dir_x, dir_y, dir_z);
+                } else {
+                    double phi, sin_phi, cos_phi;
+                    std::tie(dir_z, phi) = rng.rand_dir();
+                    double sin_theta = sqrt(1 - sqr(dir_z));
+                    sincos(phi, &sin_phi, &cos_phi);
+                    dir_x = sin_theta*cos_phi;
+                    dir_y = sin_theta*sin_phi;
+                }
+
+                // Emission kick
+                particles.kick(p, v_kick*dir_x, v_kick*dir_y, v_kick*dir_z);
+                d_v_sqr += particles.speed_sqr(p) - v_sqr_before;
+                break;
+            }
+            t += fast ? rng.rand_waiting_time_fast(rate_bound) :
+                rng.rand_waiting_time(rate_bound);
+        }
+        t_next[p] = t;
+    }
+    counts.n_heat += n_heat;
+    counts.n_cool += n_cool;
+    delta_v_sqr += d_v_sqr;
+}
+
+void write_speed_distr(std::string fname, const ParticleEnsemble& particles,
+    bool binary) {
+    auto outfile = make_table_writer(fname, 0, binary);
+    // Write in blocks rather than one value at a time
+    std::vector<double> speeds(std::min(particles.size(), 1u << 16));
+    for(unsigned block = 0; block < particles.size(); block += speeds.size()) {
+        unsigned len = std::min(static_cast<unsigned>(speeds.size()),
+            particles.size() - block);
+        for(unsigned i = 0; i < len; ++i) {
+            speeds[i] = particles.speed(block + i);
+        }
+        outfile->write(speeds.data(), len);
+    }
+    outfile->close();
+}
+
+double calc_ramp(double t, double init, double final, double rate) {
+    return std::max(std::min(init, final),
+        std::min(std::max(init, final),
+            init + rate*t
+        ));
+}
\ No newline at end of file
@@ -0,0 +1,143 @@
+// A single optical molasses simulation run for one set of parameters
+#ifndef MOLASSESSIMULATION_HPP_
+#define MOLASSESSIMULATION_HPP_
+
+#include <cmath>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <cstdio>
+#include <stdexcept>
+#include <iomanip>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include "lasercool/iotag.hpp"
+#include "lasercool/tableio.hpp"
+#include "lasercool/fundconst.hpp"
+#include "lasercool/threadpool.hpp"
+#include "mathutil.hpp"
+#include "PhysicalParams.hpp"
+#include "ParticleEnsemble.hpp"
+#include "RandProcesses.hpp"
+#include "CollisionEngine.hpp"
+#include "pcg_random.hpp"
+#include "binio.hpp"
+#include "Observables.hpp"
+
+// Tallies of photon absorption events, split by whether the absorbed photon
+// travelled along (heating) or against (cooling) the particle's motion
+struct EventCounts {
+    unsigned long n_heat, n_cool;
+};
+
+// Scratch space for absorb_emit(), which works through one block of
+// particles at a time
+struct PhotonBuffers {
+    static const unsigned block_size = 512;
+    // Absorption probabilities and the uniform variates they're rolled
+    // against
+    AlignedVector<double> absorb_prob, rand_u;
+    // Block-local indexes of the particles that absorbed a photon
+    std::vector<unsigned> events;
+    // Emission directions for each absorption event
+    std::array<AlignedVector<double>, 3> dir;
+
+    PhotonBuffers(): absorb_prob(block_size), rand_u(block_size),
+        events(block_size) {
+        for(auto& d: dir) {
+            d.resize(block_size);
+        }
+    }
+};
+
+// Constants in the photon absorption rate as a function of detuning,
+// rate = numer/(detuning^2 + offset), for kernels that don't want to
+// recompute them for every particle
+struct AbsorbRateCoeffs {
+    double numer, offset;
+
+    AbsorbRateCoeffs(double decay_rate, double rabi_freq):
+        numer(0.25*decay_rate*sqr(rabi_freq)),
+        offset(0.5*sqr(rabi_freq) + 0.25*sqr(decay_rate)) {}
+};
+
+// Summary of a finished run
+struct SimResults {
+    // Temperatures are (2/3)*(average kinetic energy)/k_B
+    double initial_temp, final_temp;
+    // Time taken for the temperature to relax 1/e of the way from its
+    // initial to its final value (nan if it never does)
+    double cooling_time;
+    unsigned long n_heat, n_cool, n_collisions;
+    // Wall-clock time in seconds
+    double runtime;
+};
+
+class MolassesSimulation {
+    private:
+        const PhysicalParams params;
+        ThreadPool pool;
+        // Thread t of the pool draws from rngs[t]
+        std::vector< RandProcesses<pcg32> > rngs;
+        ParticleEnsemble particles;
+        // Per-thread scratch space and tallies for the photon updates
+        std::vector<PhotonBuffers> photon_buffers;
+        std::vector<EventCounts> counts;
+        // Time of each particle's next candidate photon event, for the
+        // event-driven engine
+        AlignedVector<double> t_next;
+        CollisionEngine collisions;
+        // Index of the next time step to run
+        unsigned step;
+        unsigned long n_collisions;
+        Observables observables;
+
+        // Tag identifying the parameters in output file names
+        std::string filename_suffix() const;
+    public:
+        // Set up the particles and RNGs. The pool gets params.n_threads
+        // threads, but never more than one per particle
+        MolassesSimulation(const PhysicalParams&);
+        MolassesSimulation(const MolassesSimulation&) = delete;
+        MolassesSimulation& operator=(const MolassesSimulation&) = delete;
+
+        // Run the simulation through to the end. If an output directory is
+        // given, the average kinetic energy and per-axis temperatures over
+        // time, the speed histograms if enabled, and the initial and final
+        // speed distributions are written there, along with periodic
+        // checkpoints if params.steps_between_checkpoints is nonzero
+        SimResults run(std::string output_dir="");
+
+        // Save or restore the complete simulation state in a binary file.
+        // A run continued from a checkpoint with the same parameters gives
+        // exactly the same results as an uninterrupted one. The duration
+        // can be changed in between to extend a run
+        void save_checkpoint(std::string) const;
+        void load_checkpoint(std::string);
+};
+
+// Absorb and re-emit photons from the 6 lasers over one time step for the
+// particles in [begin, end), given the detuning and laser wavenumber.
+// The change in the sum of squared speeds is added to the last argument.
+// With params.fast_kernel, the absorption test is rearranged to avoid
+// divisions and emission directions are sampled without trig functions
+void absorb_emit(ParticleEnsemble&, unsigned, unsigned, const PhysicalParams&,
+    double, double, RandProcesses<pcg32>&, PhotonBuffers&, EventCounts&,
+    double&);
+// Same as absorb_emit(), but event-driven: every particle jumps straight
+// from one candidate photon event to the next, which are sampled by thinning
+// against a bound on the total absorption rate, until the given end time.
+// The array of next candidate event times is updated in place. With
+// params.fast_kernel, discarded candidates are found without any divisions
+// and emission directions are sampled without trig functions
+void absorb_emit_events(ParticleEnsemble&, unsigned, unsigned,
+    const PhysicalParams&, double, double*, RandProcesses<pcg32>&,
+    EventCounts&, double&);
+// Write the speed of every particle to a file, as text or .npy
+void write_speed_distr(std::string, const ParticleEnsemble&, bool);
+// Calculate a ramped quantity over time given the initial and final values,
+// and the ramp rate
+double calc_ramp(double, double, double, double);
+
+#endif
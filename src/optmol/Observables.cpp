@@ -0,0 +1,116 @@
+#include "Observables.hpp"
+
+Observables::Observables(double mass, unsigned n_particles,
+    unsigned n_threads, unsigned n_hist_bins):
+    mass(mass), n_particles(n_particles), n_hist_bins(n_hist_bins),
+    sum_v_sqr(0), deltas(n_threads, 0) {}
+
+// Running count, mean, and sum of squared deviations from the mean
+struct WelfordStats {
+    double n, mean, M2;
+
+    void add(double x) {
+        n++;
+        double delta = x - mean;
+        mean += delta / n;
+        M2 += delta*(x - mean);
+    }
+    // Combine with the stats of another set of values
+    void merge(const WelfordStats& other) {
+        double n_total = n + other.n;
+        if(n_total == 0) return;
+        double delta = other.mean - mean;
+        mean += delta*other.n / n_total;
+        M2 += other.M2 + sqr(delta)*n*other.n / n_total;
+        n = n_total;
+    }
+};
+
+void Observables::take_snapshot(double t, const ParticleEnsemble& particles,
+    ThreadPool& pool) {
+    // Per-thread partial results
+    std::vector< std::array<WelfordStats, 3> > stats(pool.size());
+    std::vector<double> partial_sums(pool.size()), max_v_sqr(pool.size());
+    pool.run([&](unsigned tid) {
+        unsigned begin, end;
+        std::tie(begin, end) = pool.chunk(n_particles, tid);
+        double sum = 0, max_sqr = 0;
+        for(unsigned c = 0; c < 3; ++c) {
+            WelfordStats s{0, 0, 0};
+            const double* vc = particles.component(c);
+            for(unsigned p = begin; p < end; ++p) {
+                s.add(vc[p]);
+            }
+            stats[tid][c] = s;
+        }
+        for(unsigned p = begin; p < end; ++p) {
+            double v_sqr = particles.speed_sqr(p);
+            sum += v_sqr;
+            max_sqr = std::max(max_sqr, v_sqr);
+        }
+        partial_sums[tid] = sum;
+        max_v_sqr[tid] = max_sqr;
+    });
+
+    sum_v_sqr = 0;
+    for(auto s: partial_sums) {
+        sum_v_sqr += s;
+    }
+    std::fill(deltas.begin(), deltas.end(), 0);
+    times.push_back(t);
+    avg_KEs.push_back(avg_kinetic_energy());
+    for(unsigned c = 0; c < 3; ++c) {
+        WelfordStats total{0, 0, 0};
+        for(const auto& s: stats) {
+            total.merge(s[c]);
+        }
+        // Temperature from the velocity variance along the axis:
+        // m<(v - <v>)^2> = kT
+        axis_temps.push_back(mass*total.M2
+            / (total.n*fundamental_constants::K_BOLTZMANN));
+    }
+
+    if(n_hist_bins == 0) return;
+    // Widen the top bin slightly so the fastest particle falls inside it
+    double max_speed = sqrt(*std::max_element(max_v_sqr.begin(),
+        max_v_sqr.end()));
+    double bin_width = (max_speed > 0 ? max_speed : 1)
+        * (1 + 1e-12) / n_hist_bins;
+    std::vector< std::vector<double> > partial_hists(pool.size(),
+        std::vector<double>(n_hist_bins, 0));
+    pool.run([&](unsigned tid) {
+        unsigned begin, end;
+        std::tie(begin, end) = pool.chunk(n_particles, tid);
+        std::vector<double>& hist = partial_hists[tid];
+        for(unsigned p = begin; p < end; ++p) {
+            unsigned bin = static_cast<unsigned>(particles.speed(p)/bin_width);
+            hist[std::min(bin, n_hist_bins - 1)]++;
+        }
+    });
+    histograms.push_back(bin_width);
+    for(unsigned b = 0; b < n_hist_bins; ++b) {
+        double count = 0;
+        for(const auto& hist: partial_hists) {
+            count += hist[b];
+        }
+        histograms.push_back(count);
+    }
+}
+
+void Observables::save(std::ostream& out) const {
+    write_binary(out, sum_v_sqr);
+    write_binary(out, deltas);
+    write_binary(out, times);
+    write_binary(out, avg_KEs);
+    write_binary(out, axis_temps);
+    write_binary(out, histograms);
+}
+
+void Observables::load(std::istream& in) {
+    read_binary(in, sum_v_sqr);
+    read_binary(in, deltas);
+    read_binary(in, times);
+    read_binary(in, avg_KEs);
+    read_binary(in, axis_temps);
+    read_binary(in, histograms);
+}
@@ -0,0 +1,69 @@
+// Running measurements of the particle ensemble
+#ifndef OBSERVABLES_HPP_
+#define OBSERVABLES_HPP_
+
+#include <cmath>
+#include <vector>
+#include <array>
+#include <iostream>
+#include <algorithm>
+#include "lasercool/fundconst.hpp"
+#include "mathutil.hpp"
+#include "binio.hpp"
+#include "ParticleEnsemble.hpp"
+#include "lasercool/threadpool.hpp"
+
+// The average kinetic energy is needed on every time step, so rather than
+// summing over all the particles each time, the sum of squared speeds is
+// kept up to date from the change caused by every photon kick. Collisions
+// conserve kinetic energy and don't change it. Each thread tallies its
+// own changes, which are folded in by collect().
+//
+// Full passes over the ensemble only happen at snapshots. These also
+// resynchronize the sum, so that rounding errors don't build up, and record
+// per-axis temperatures (from parallel Welford variances) and, optionally,
+// a histogram of particle speeds.
+class Observables {
+    private:
+        double mass;
+        unsigned n_particles, n_hist_bins;
+        double sum_v_sqr;
+        // Per-thread changes to sum_v_sqr since the last collect()
+        std::vector<double> deltas;
+    public:
+        // Snapshot history. Every snapshot has a time, an average kinetic
+        // energy, 3 per-axis temperatures, and if histograms are on, a bin
+        // width followed by the counts in each bin. Bins start at speed 0
+        // and are sized to fit the fastest particle
+        std::vector<double> times, avg_KEs, axis_temps, histograms;
+
+        // Particle mass, number of particles and threads, and number of
+        // histogram bins (0 for none)
+        Observables(double, unsigned, unsigned, unsigned n_hist_bins=0);
+
+        unsigned hist_bins() const {return n_hist_bins;}
+        unsigned n_snapshots() const {return times.size();}
+
+        // Change in the sum of squared speeds from a thread's kicks
+        double& delta(unsigned tid) {return deltas[tid];}
+        // Fold the threads' changes into the running sum
+        void collect() {
+            for(auto& d: deltas) {
+                sum_v_sqr += d;
+                d = 0;
+            }
+        }
+        double avg_kinetic_energy() const {
+            return 0.5*mass*sum_v_sqr / n_particles;
+        }
+
+        // Full pass over the ensemble, split across the pool. Resets the
+        // running sum and appends a snapshot at the given time
+        void take_snapshot(double, const ParticleEnsemble&, ThreadPool&);
+
+        // Binary checkpointing of the running sum and snapshot history
+        void save(std::ostream&) const;
+        void load(std::istream&);
+};
+
+#endif
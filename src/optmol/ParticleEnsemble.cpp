@@ -0,0 +1,28 @@
+#include "ParticleEnsemble.hpp"
+
+ParticleEnsemble::ParticleEnsemble(unsigned n_particles) {
+    for(auto& vc: v) {
+        vc.assign(n_particles, 0);
+    }
+}
+
+void ParticleEnsemble::scatter(unsigned i, unsigned j,
+    double dirx, double diry, double dirz) {
+    double half_rel_speed = rel_speed(i, j) / 2;
+    double dir[3] = {dirx, diry, dirz};
+    for(unsigned c = 0; c < 3; ++c) {
+        double v_cm = (v[c][i] + v[c][j]) / 2;
+        v[c][i] = v_cm + half_rel_speed*dir[c];
+        v[c][j] = v_cm - half_rel_speed*dir[c];
+    }
+}
+
+double ParticleEnsemble::avg_kinetic_energy(double mass) const {
+    const double *vx = component(0), *vy = component(1), *vz = component(2);
+    unsigned n = size();
+    double sum_v_sqr = 0;
+    for(unsigned i = 0; i < n; ++i) {
+        sum_v_sqr += sqr(vx[i]) + sqr(vy[i]) + sqr(vz[i]);
+    }
+    return 0.5*mass*sum_v_sqr / n;
+}
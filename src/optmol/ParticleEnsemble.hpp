@@ -0,0 +1,93 @@
+// Contiguous structure-of-arrays storage for the velocities of an ensemble
+// of particles
+#ifndef PARTICLEENSEMBLE_HPP_
+#define PARTICLEENSEMBLE_HPP_
+
+#include <cmath>
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+#include <array>
+#include <vector>
+#include "mathutil.hpp"
+
+// Minimal allocator that aligns storage to a given boundary (default is a
+// cache line, which also covers AVX-512 vector width)
+template<typename T, std::size_t alignment = 64>
+struct AlignedAllocator {
+    typedef T value_type;
+    template<typename U> struct rebind {
+        typedef AlignedAllocator<U, alignment> other;
+    };
+
+    AlignedAllocator() {}
+    template<typename U>
+    AlignedAllocator(const AlignedAllocator<U, alignment>&) {}
+
+    T* allocate(std::size_t n) {
+        void* p = nullptr;
+        if(posix_memalign(&p, alignment, n*sizeof(T)) != 0) {
+            throw std::bad_alloc();
+        }
+        return static_cast<T*>(p);
+    }
+    void deallocate(T* p, std::size_t) {free(p);}
+};
+template<typename T, typename U, std::size_t alignment>
+bool operator==(const AlignedAllocator<T, alignment>&,
+    const AlignedAllocator<U, alignment>&) {return true;}
+template<typename T, typename U, std::size_t alignment>
+bool operator!=(const AlignedAllocator<T, alignment>&,
+    const AlignedAllocator<U, alignment>&) {return false;}
+
+template<typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
+// Particle velocities, stored as one contiguous array per Cartesian
+// component so that loops over particles are unit-stride
+struct ParticleEnsemble {
+    // v[0], v[1], v[2] hold vx, vy, vz for every particle
+    std::array<AlignedVector<double>, 3> v;
+
+    ParticleEnsemble(unsigned n_particles=0);
+
+    unsigned size() const {return v[0].size();}
+
+    // Raw pointer to one velocity component of all particles
+    double* component(unsigned c) {return v[c].data();}
+    const double* component(unsigned c) const {return v[c].data();}
+
+    // Velocity kick along a single component
+    void kick(unsigned i, unsigned c, double dv) {v[c][i] += dv;}
+    // Velocity kick along all three components
+    void kick(unsigned i, double dvx, double dvy, double dvz) {
+        v[0][i] += dvx;
+        v[1][i] += dvy;
+        v[2][i] += dvz;
+    }
+
+    double speed_sqr(unsigned i) const {
+        return sqr(v[0][i]) + sqr(v[1][i]) + sqr(v[2][i]);
+    }
+    double speed(unsigned i) const {return sqrt(speed_sqr(i));}
+
+    // Squared relative speed between two particles
+    double rel_speed_sqr(unsigned i, unsigned j) const {
+        return sqr(v[0][i] - v[0][j]) + sqr(v[1][i] - v[1][j])
+            + sqr(v[2][i] - v[2][j]);
+    }
+    // Relative speed between two particles
+    double rel_speed(unsigned i, unsigned j) const {
+        return sqrt(rel_speed_sqr(i, j));
+    }
+
+    // Scatter two particles in a collision, in place. The center-of-mass
+    // velocity is conserved and the relative velocity is rotated onto the
+    // given unit vector
+    void scatter(unsigned, unsigned, double, double, double);
+
+    // Average kinetic energy of the ensemble
+    double avg_kinetic_energy(double) const;
+};
+
+#endif
@@ -1,6 +1,12 @@
 #include "PhysicalParams.hpp"
 
+const unsigned PhysicalParams::n_lasers;
+
 PhysicalParams::PhysicalParams(std::string species, std::string fname):
+    PhysicalParams(species, read_config(fname)) {}
+
+PhysicalParams::PhysicalParams(std::string species,
+    const std::unordered_map<std::string, double>& config):
     particle_species(species) {
     // Set particle-species–specific parameters
     // Resonant wavenumber is the wavenumber of the atomic transition
@@ -17,8 +23,10 @@ PhysicalParams::PhysicalParams(std::string species, std::string fname):
     }
 
     // Read in parameters from cfg file
-    double n_particles_double;
-    load_params(fname,
+    double n_particles_double, n_threads_double, seed_double, engine_double,
+        output_format_double, n_snapshots_double, n_histogram_bins_double,
+        fast_kernel_double;
+    load_params(config,
         {
             {"rabi_frequency", &rabi_freq_per_decay_rate},
             {"initial_detuning", &initial_detuning_per_decay_rate},
@@ -28,10 +36,48 @@ PhysicalParams::PhysicalParams(std::string species, std::string fname):
             {"time_step", &dt_by_max_absorb_rate},
             {"duration", &duration_by_max_absorb_rate},
             {"n_particles", &n_particles_double},
-            {"particle_density", &particle_density}
+            {"particle_density", &particle_density},
+            {"collision_speed_floor", &collision_speed_floor},
+            {"threads", &n_threads_double},
+            {"seed", &seed_double},
+            {"absorption_engine", &engine_double},
+            {"output_format", &output_format_double},
+            {"fast_kernel", &fast_kernel_double},
+            {"snapshots", &n_snapshots_double},
+            {"histogram_bins", &n_histogram_bins_double},
+            {"checkpoint_interval", &checkpoint_interval_by_max_absorb_rate}
         }
     );
     n_particles = static_cast<unsigned>(n_particles_double);
+    if(std::isnan(collision_speed_floor)) {
+        collision_speed_floor = 0;
+    } else if(collision_speed_floor < 0) {
+        throw std::invalid_argument("Negative collision speed floor");
+    }
+    n_threads = std::isnan(n_threads_double) ?
+        0 : static_cast<unsigned>(n_threads_double);
+    seed = std::isnan(seed_double) ? 0 : static_cast<unsigned long>(seed_double);
+    if(engine_double == 0 || std::isnan(engine_double)) {
+        absorption_engine = fixed_step_engine;
+    } else if(engine_double == 1) {
+        absorption_engine = event_driven_engine;
+    } else {
+        throw std::invalid_argument("Invalid absorption engine");
+    }
+    if(fast_kernel_double == 0 || std::isnan(fast_kernel_double)) {
+        fast_kernel = false;
+    } else if(fast_kernel_double == 1) {
+        fast_kernel = true;
+    } else {
+        throw std::invalid_argument("Invalid fast kernel setting");
+    }
+    if(output_format_double == 0 || std::isnan(output_format_double)) {
+        binary_output = false;
+    } else if(output_format_double == 1) {
+        binary_output = true;
+    } else {
+        throw std::invalid_argument("Invalid output format");
+    }
     rabi_freq = rabi_freq_per_decay_rate * decay_rate;
     // Set time scale in terms of maximum photon absorption rate
     max_absorb_rate = calc_absorb_rate(decay_rate, rabi_freq);
@@ -39,6 +85,24 @@ PhysicalParams::PhysicalParams(std::string species, std::string fname):
     duration = duration_by_max_absorb_rate / max_absorb_rate;
     n_time_steps = static_cast<unsigned>(ceil(
         duration_by_max_absorb_rate / dt_by_max_absorb_rate));
+    if(std::isnan(n_snapshots_double) || n_snapshots_double == 0) {
+        n_snapshots = 1001;
+    } else if(n_snapshots_double >= 2) {
+        n_snapshots = static_cast<unsigned>(n_snapshots_double);
+    } else {
+        throw std::invalid_argument("Need at least 2 snapshots");
+    }
+    steps_between_snapshots = std::max(1u, n_time_steps / (n_snapshots - 1));
+    n_histogram_bins = std::isnan(n_histogram_bins_double) ?
+        0 : static_cast<unsigned>(n_histogram_bins_double);
+    if(std::isnan(checkpoint_interval_by_max_absorb_rate)
+        || checkpoint_interval_by_max_absorb_rate <= 0) {
+        checkpoint_interval_by_max_absorb_rate = 0;
+        steps_between_checkpoints = 0;
+    } else {
+        steps_between_checkpoints = std::max(1u, static_cast<unsigned>(round(
+            checkpoint_interval_by_max_absorb_rate / dt_by_max_absorb_rate)));
+    }
     
     // Precompute certain values for the scattering rate
     // So each particle has on average one collision per time step
@@ -50,6 +114,15 @@ PhysicalParams::PhysicalParams(std::string species, std::string fname):
         / (M_PI*sqr(fundamental_constants::VACUUM_PERMITTIVITY*mass));
 
     // Defaults and conversion to SI //
+    if(n_threads == 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if(seed == 0) {
+        // Keep to 52 bits so the seed survives a round trip through the
+        // config values, which are doubles
+        seed = (static_cast<unsigned long>(std::random_device{}()) << 20)
+            ^ std::random_device{}();
+    }
     if(std::isnan(final_detuning_per_decay_rate)) {
         final_detuning_per_decay_rate = -0.5;   // Gives Doppler temperature
     }
@@ -78,6 +151,8 @@ void PhysicalParams::print() {
         << "    Particle species: " << particle_species << std::endl
         << "    N: " << n_particles << std::endl
         << "    Density: " << particle_density << std::endl
+        << "    Collision speed floor / RMS relative speed: "
+        << collision_speed_floor << std::endl
         << "    Rabi frequency per decay rate: " << rabi_freq_per_decay_rate
         << std::endl
         << "    Initial detuning per decay rate: "
@@ -93,7 +168,19 @@ void PhysicalParams::print() {
         << "    Time step * max absorption rate: " << dt_by_max_absorb_rate
         << std::endl
         << "    Duration * max absorption rate: " << duration_by_max_absorb_rate
-        << std::endl;
+        << std::endl
+        << "    Absorption engine: "
+        << (absorption_engine == event_driven_engine ?
+            "event-driven" : "fixed step")
+        << (fast_kernel ? " (fast kernel)" : "") << std::endl
+        << "    Output format: " << (binary_output ? "npy" : "text")
+        << std::endl
+        << "    Snapshots: " << n_snapshots << std::endl
+        << "    Speed histogram bins: " << n_histogram_bins << std::endl
+        << "    Checkpoint interval * max absorption rate: "
+        << checkpoint_interval_by_max_absorb_rate << std::endl
+        << "    Threads: " << n_threads << std::endl
+        << "    RNG seed: " << seed << std::endl;
     // Output useful, theoretically calculated quantities related to optimization
     std::cout << "Optimal initial detuning per decay rate: "
         << optimal_detuning(initial_temp, mass,
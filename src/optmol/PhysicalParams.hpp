@@ -4,6 +4,10 @@
 #include <cmath>
 #include <iostream>
 #include <string>
+#include <unordered_map>
+#include <random>
+#include <thread>
+#include <algorithm>
 #include <stdexcept>
 #include "lasercool/readcfg.hpp"
 #include "lasercool/fundconst.hpp"
@@ -12,6 +16,12 @@
 
 // Read, calculate, and hold relevant physical parameters
 struct PhysicalParams {
+    // Lasers shine in both directions along each Cartesian axis
+    static const unsigned n_lasers = 6;
+    // Ways to simulate photon absorption: trials at every fixed time step,
+    // or sampling the time of the next event directly
+    enum absorption_engine_type {fixed_step_engine, event_driven_engine};
+
     // Particle species stuff
     std::string particle_species;
     double mass, decay_rate, resonant_wavenumber;
@@ -23,6 +33,24 @@ struct PhysicalParams {
     double dt_by_max_absorb_rate, duration_by_max_absorb_rate;
     unsigned n_particles;
     double particle_density;
+    // Collision probabilities are evaluated at no less than this times the
+    // RMS relative speed, which lets fewer pairs be tested (0 for exact)
+    double collision_speed_floor;
+    // Number of worker threads (0 for one per hardware thread), and the RNG
+    // seed (0 for a nondeterministic seed)
+    unsigned n_threads;
+    unsigned long seed;
+    absorption_engine_type absorption_engine;
+    // Use the faster, rearranged photon absorption/emission kernels
+    bool fast_kernel;
+    // Write output as .npy binary instead of text
+    bool binary_output;
+    // Number of snapshots of the observables, including the initial one,
+    // and number of bins in the speed histograms (0 for none)
+    unsigned n_snapshots, n_histogram_bins;
+    // Simulated time between checkpoints, in units of 1/(max absorption
+    // rate). 0 for no checkpoints
+    double checkpoint_interval_by_max_absorb_rate;
 
     // Stuff in SI units
     double rabi_freq, initial_detuning, final_detuning, detuning_ramp_rate;
@@ -31,12 +59,15 @@ struct PhysicalParams {
     // Calculated stuff
     double max_absorb_rate;
     unsigned n_time_steps;
+    unsigned steps_between_snapshots, steps_between_checkpoints;
     unsigned collisions_per_step;
     double scatter_coeff;
 
     // Initialize with a given particle species and
     // read other parameters in from a config file
     PhysicalParams(std::string, std::string);
+    // Same as above, but with the config file already read in
+    PhysicalParams(std::string, const std::unordered_map<std::string, double>&);
     // Print out params to console
     void print();
 
@@ -47,6 +78,15 @@ struct PhysicalParams {
             / (sqr(detuning) + 0.5*sqr(rabi_freq) + 0.25*sqr(decay_rate));
     }
 
+    // Coulomb logarithm for collisions in a plasma with a given average
+    // kinetic energy and density. 1+ to keep the argument above 1
+    inline static double calc_coulomb_log(double avgKE, double density) {
+        return log(1
+            + 12*M_PI/cube(fundamental_constants::ELEMENTARY_CHARGE)
+            * sqrt(8*cube(fundamental_constants::VACUUM_PERMITTIVITY*avgKE)
+            /(27*density)));
+    }
+
     inline static double calc_laser_wavenumber(double resonant_wavenumber,
         double detuning) {
         return resonant_wavenumber + detuning/fundamental_constants::SPEED_OF_LIGHT;
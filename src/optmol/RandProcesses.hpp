@@ -5,12 +5,21 @@
 
 #include <cmath>
 #include <random>
+#include <string>
+#include <sstream>
+#include <stdexcept>
 #include <utility>
+#include <algorithm>
 
 template<typename rngtype>
 class RandProcesses {
     private:
+        typedef typename rngtype::result_type raw_type;
+        // Number of raw draws buffered at a time by the batch methods
+        static const unsigned batch_size = 256;
+
         rngtype generator;
+        double thermal_v_stddev;
         // Mean 0 and stddev given at initialization
         std::normal_distribution<> thermal_v_dist;
         // Uniform [0, 1)
@@ -24,11 +33,31 @@ class RandProcesses {
     public:
         // Initialize with relevant physical parameters
         RandProcesses(rngtype generator, double thermal_v_stddev, unsigned n_particles):
-            generator(generator), thermal_v_dist(0., thermal_v_stddev),
+            generator(generator), thermal_v_stddev(thermal_v_stddev),
+            thermal_v_dist(0., thermal_v_stddev),
             uniform_dist(), uniform_phi_dist(0., 2*M_PI),
             uniform_costheta_dist(-1., 1.),
             idx_dist(0, n_particles-1) {}
 
+        // Full state of the generator and the distributions, as text, so
+        // that a run can be stopped and continued exactly. The normal
+        // distribution caches one of each pair of variates it generates
+        std::string state() const {
+            std::ostringstream ss;
+            ss << generator << " " << thermal_v_dist << " " << uniform_dist
+                << " " << uniform_phi_dist << " " << uniform_costheta_dist
+                << " " << idx_dist;
+            return ss.str();
+        }
+        void set_state(const std::string& state) {
+            std::istringstream ss(state);
+            ss >> generator >> thermal_v_dist >> uniform_dist
+                >> uniform_phi_dist >> uniform_costheta_dist >> idx_dist;
+            if(!ss) {
+                throw std::runtime_error("Invalid random generator state");
+            }
+        }
+
         // Generate velocities from a thermal distribution
         double rand_thermal_velocity() {return thermal_v_dist(generator);}
 
@@ -42,6 +71,31 @@ class RandProcesses {
             return std::make_pair(idx1, idx2);
         }
 
+        // Uniform index in [0, n-1]. Assumes n > 0
+        unsigned rand_index(unsigned n) {
+            return std::uniform_int_distribution<unsigned>(0, n-1)(generator);
+        }
+
+        // U[0, 1)
+        double rand_uniform() {return uniform_dist(generator);}
+
+        // Waiting time until the next event of a Poisson process
+        double rand_waiting_time(double rate) {
+            return -log1p(-uniform_dist(generator)) / rate;
+        }
+
+        // Faster versions of the above, from a single raw draw each, i.e.
+        // 32 bits of randomness for pcg32 (the std distributions combine two
+        // raw draws to fill a double). The uniform variate is in U(0, 1), so
+        // the waiting time is always finite
+        double rand_uniform_fast() {
+            return (static_cast<double>(generator() - rngtype::min()) + 0.5)
+                / (static_cast<double>(rngtype::max() - rngtype::min()) + 1);
+        }
+        double rand_waiting_time_fast(double rate) {
+            return -log(rand_uniform_fast()) / rate;
+        }
+
         // Rolls a random success or failure with given success probability
         bool rand_success_with_prob(double prob) {
             return uniform_dist(generator) < prob;
@@ -53,6 +107,145 @@ class RandProcesses {
             return std::make_pair(
                 uniform_costheta_dist(generator), uniform_phi_dist(generator));
         }
+
+        // Random direction on the unit sphere as a Cartesian unit vector,
+        // without any trig functions (Marsaglia's method). A point (a, b) is
+        // drawn uniformly from the unit disk by rejection, and with
+        // s = a^2 + b^2, (2a*sqrt(1 - s), 2b*sqrt(1 - s), 1 - 2s) is uniform
+        // on the sphere
+        void rand_dir_cartesian(double& x, double& y, double& z) {
+            double a, b, s;
+            do {
+                a = uniform_costheta_dist(generator);
+                b = uniform_costheta_dist(generator);
+                s = a*a + b*b;
+            } while(s >= 1);
+            double w = 2*sqrt(1 - s);
+            x = a*w;
+            y = b*w;
+            z = 1 - 2*s;
+        }
+
+        // Batch methods. These fill caller-provided arrays, drawing raw
+        // integers from the generator (inherently serial) into a small
+        // buffer and then transforming the whole buffer in branch-free loops
+        // that the compiler can vectorize.
+
+        // Fill with U[0, 1) variates at the same resolution as
+        // rand_uniform(), combining two raw draws into each one
+        void fill_uniform(double* out, unsigned n) {
+            const double scale = 1/(static_cast<double>(
+                rngtype::max() - rngtype::min()) + 1);
+            // Rounding the combined draws can give exactly 1
+            const double below_one = std::nextafter(1., 0.);
+            raw_type raw[batch_size];
+            for(unsigned start = 0; start < n; start += batch_size/2) {
+                unsigned len = std::min(batch_size/2, n - start);
+                for(unsigned i = 0; i < 2*len; ++i) {
+                    raw[i] = generator();
+                }
+                double* o = out + start;
+                for(unsigned i = 0; i < len; ++i) {
+                    double low = static_cast<double>(raw[2*i] - rngtype::min());
+                    double high = static_cast<double>(
+                        raw[2*i + 1] - rngtype::min());
+                    o[i] = std::min((low + high/scale)*scale*scale, below_one);
+                }
+            }
+        }
+
+        // Faster version of fill_uniform() from a single raw draw each, i.e.
+        // 32 bits of randomness for pcg32, which is coarser than small
+        // probabilities may need. U(0, 1) if open is true
+        void fill_uniform_fast(double* out, unsigned n, bool open=false) {
+            const double scale = 1/(static_cast<double>(
+                rngtype::max() - rngtype::min()) + 1);
+            const double offset = open ? 0.5 : 0;
+            raw_type raw[batch_size];
+            for(unsigned start = 0; start < n; start += batch_size) {
+                unsigned len = std::min(batch_size, n - start);
+                for(unsigned i = 0; i < len; ++i) {
+                    raw[i] = generator();
+                }
+                double* o = out + start;
+                for(unsigned i = 0; i < len; ++i) {
+                    o[i] = (static_cast<double>(raw[i] - rngtype::min())
+                        + offset) * scale;
+                }
+            }
+        }
+
+        // Fill with thermal velocities, using the Box-Muller transform
+        void fill_thermal_velocity(double* out, unsigned n) {
+            double u1[batch_size/2], u2[batch_size/2];
+            for(unsigned start = 0; start < n; start += batch_size) {
+                unsigned len = std::min(batch_size, n - start);
+                unsigned npairs = (len + 1) / 2;
+                // Open interval keeps log() finite
+                fill_uniform_fast(u1, npairs, true);
+                fill_uniform_fast(u2, npairs);
+                double* o = out + start;
+                for(unsigned i = 0; i < len/2; ++i) {
+                    double r = thermal_v_stddev*sqrt(-2*log(u1[i]));
+                    double phi = 2*M_PI*u2[i];
+                    o[2*i] = r*cos(phi);
+                    o[2*i + 1] = r*sin(phi);
+                }
+                if(len % 2) {
+                    o[len - 1] = thermal_v_stddev*sqrt(-2*log(u1[npairs - 1]))
+                        * cos(2*M_PI*u2[npairs - 1]);
+                }
+            }
+        }
+
+        // Fill with the Cartesian components of random directions on the
+        // unit sphere, from cos(theta) ~ U(-1, 1) and phi ~ U(0, 2*pi).
+        // Rejection-free, so every output costs exactly two raw draws
+        void fill_dir(double* x, double* y, double* z, unsigned n) {
+            double u[batch_size];
+            for(unsigned start = 0; start < n; start += batch_size/2) {
+                unsigned len = std::min(batch_size/2, n - start);
+                fill_uniform_fast(u, 2*len);
+                double *xs = x + start, *ys = y + start, *zs = z + start;
+                for(unsigned i = 0; i < len; ++i) {
+                    double cos_theta = 2*u[i] - 1;
+                    double sin_theta = sqrt(1 - cos_theta*cos_theta);
+                    double phi = 2*M_PI*u[len + i];
+                    xs[i] = sin_theta*cos(phi);
+                    ys[i] = sin_theta*sin(phi);
+                    zs[i] = cos_theta;
+                }
+            }
+        }
+
+        // Same as fill_dir(), but with Marsaglia's method (see
+        // rand_dir_cartesian()), so no trig functions are needed. Each
+        // output costs 8/pi raw draws on average
+        void fill_dir_marsaglia(double* x, double* y, double* z, unsigned n) {
+            double u[batch_size];
+            unsigned filled = 0;
+            while(filled < n) {
+                // Enough pairs to finish on the first try most of the time,
+                // since pi/4 of them are accepted on average
+                unsigned remaining = n - filled;
+                unsigned npairs = std::min(batch_size/2,
+                    remaining + remaining/3 + 4);
+                fill_uniform_fast(u, 2*npairs);
+                for(unsigned i = 0; i < npairs && filled < n; ++i) {
+                    double a = 2*u[2*i] - 1, b = 2*u[2*i + 1] - 1;
+                    double s = a*a + b*b;
+                    if(s >= 1) continue;
+                    double w = 2*sqrt(1 - s);
+                    x[filled] = a*w;
+                    y[filled] = b*w;
+                    z[filled] = 1 - 2*s;
+                    ++filled;
+                }
+            }
+        }
 };
 
+template<typename rngtype>
+const unsigned RandProcesses<rngtype>::batch_size;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,60 @@
+// Raw binary reading and writing of plain values, vectors, and strings, for
+// checkpoint files. Not portable between machines with different
+// endianness or type sizes
+#ifndef BINIO_HPP_
+#define BINIO_HPP_
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <stdexcept>
+
+template<typename T>
+void write_binary(std::ostream& out, const T& x) {
+    static_assert(std::is_trivially_copyable<T>::value,
+        "Only plain values can be written directly");
+    out.write(reinterpret_cast<const char*>(&x), sizeof(T));
+}
+template<typename T>
+void read_binary(std::istream& in, T& x) {
+    static_assert(std::is_trivially_copyable<T>::value,
+        "Only plain values can be read directly");
+    if(!in.read(reinterpret_cast<char*>(&x), sizeof(T))) {
+        throw std::runtime_error("Unexpected end of binary file");
+    }
+}
+
+// Vectors and strings are written as their length followed by the elements
+template<typename T, typename Alloc>
+void write_binary(std::ostream& out, const std::vector<T, Alloc>& v) {
+    static_assert(std::is_trivially_copyable<T>::value,
+        "Only vectors of plain values can be written directly");
+    write_binary(out, static_cast<unsigned long>(v.size()));
+    out.write(reinterpret_cast<const char*>(v.data()), v.size()*sizeof(T));
+}
+template<typename T, typename Alloc>
+void read_binary(std::istream& in, std::vector<T, Alloc>& v) {
+    static_assert(std::is_trivially_copyable<T>::value,
+        "Only vectors of plain values can be read directly");
+    unsigned long size;
+    read_binary(in, size);
+    v.resize(size);
+    if(!in.read(reinterpret_cast<char*>(v.data()), size*sizeof(T))) {
+        throw std::runtime_error("Unexpected end of binary file");
+    }
+}
+inline void write_binary(std::ostream& out, const std::string& s) {
+    write_binary(out, static_cast<unsigned long>(s.size()));
+    out.write(s.data(), s.size());
+}
+inline void read_binary(std::istream& in, std::string& s) {
+    unsigned long size;
+    read_binary(in, size);
+    s.resize(size);
+    if(!in.read(&s[0], size)) {
+        throw std::runtime_error("Unexpected end of binary file");
+    }
+}
+
+#endif
@@ -10,25 +10,25 @@
 #include <iomanip>
 #include <chrono>
 #include <algorithm>
+#include <limits>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
 #include "lasercool/iotag.hpp"
+#include "lasercool/readcfg.hpp"
 #include "lasercool/fundconst.hpp"
+#include "lasercool/threadpool.hpp"
 #include "constants.hpp"
 #include "mathutil.hpp"
 #include "PhysicalParams.hpp"
-#include "RandProcesses.hpp"
-#include "pcg_random.hpp"
+#include "MolassesSimulation.hpp"
 
-// Calculate a ramped quantity over time given the initial and final values,
-// and the ramp rate
-double calc_ramp(double, double, double, double);
-// Calculate average kinetic energy of an ensemble
-double calc_avg_kinetic_energy(const std::vector< std::vector<double> >&,
-    double);
-// Compute the relative speed between two particles
-double calc_rel_speed(const std::vector<double>&, const std::vector<double>&);
-// Scatter two particles in a collision
-std::pair< std::vector<double>, std::vector<double> > scatter_pair(
-    const std::vector<double>&, const std::vector<double>&,
-    const std::vector<double>&);
+// Run a simulation for every point of a parameter sweep, on top of the base
+// parameters and the config values they came from, and write the results of
+// all the points to one table
+void run_sweep(const PhysicalParams&,
+    const std::unordered_map<std::string, double>&, std::string, std::string);
 
 #endif
\ No newline at end of file
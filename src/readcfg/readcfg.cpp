@@ -27,8 +27,67 @@ std::unordered_map<std::string, double> read_config(std::string fname,
 void load_params(std::string fname,
     std::vector< std::pair<std::string, double*> > params,
     std::string delimiter) {
-    auto all_params = read_config(fname, delimiter);
+    load_params(read_config(fname, delimiter), params);
+}
+
+void load_params(const std::unordered_map<std::string, double>& all_params,
+    std::vector< std::pair<std::string, double*> > params) {
     for(auto p: params) {
-        *p.second = all_params[p.first];
+        // Missing parameters read as 0
+        auto found = all_params.find(p.first);
+        *p.second = (found == all_params.end()) ? 0 : found->second;
+    }
+}
+
+std::vector< std::pair<std::string, std::vector<double> > > read_sweep(
+    std::string fname, std::string delimiter) {
+    std::vector< std::pair<std::string, std::vector<double> > > sweep;
+
+    std::ifstream infile(fname);
+    if(!infile) {
+        throw std::runtime_error("Could not open sweep file " + fname);
+    }
+    std::string line;
+    while(std::getline(infile, line)) {
+        // empty line or comment is ignored
+        if(line.empty() || line.rfind("#", 0) == 0) continue;
+        auto delim_pos = line.find(delimiter);
+        if(delim_pos == line.npos) {
+            throw std::runtime_error(
+                "Line without delimiter in sweep file " + fname);
+        }
+        std::string key = line.substr(0, delim_pos);
+        std::string spec = line.substr(delim_pos + delimiter.size());
+        std::vector<double> values;
+
+        auto range_pos = spec.find(delimiter);
+        if(range_pos != spec.npos) {
+            // start:stop:count
+            auto count_pos = spec.find(delimiter, range_pos + delimiter.size());
+            if(count_pos == spec.npos) {
+                throw std::runtime_error("Range for " + key + " in sweep file "
+                    + fname + " needs a start, stop, and count");
+            }
+            double start = std::stod(spec.substr(0, range_pos));
+            double stop = std::stod(spec.substr(range_pos + delimiter.size()));
+            int count = std::stoi(spec.substr(count_pos + delimiter.size()));
+            for(int i = 0; i < count; ++i) {
+                values.push_back(count == 1 ?
+                    start : start + (stop - start)*i/(count - 1));
+            }
+        } else {
+            // Comma-separated list
+            std::istringstream spec_ss(spec);
+            std::string value;
+            while(std::getline(spec_ss, value, ',')) {
+                values.push_back(std::stod(value));
+            }
+        }
+        sweep.emplace_back(key, values);
+    }
+    infile.close();
+    if(sweep.empty()) {
+        throw std::runtime_error("No parameters in sweep file " + fname);
     }
+    return sweep;
 }
\ No newline at end of file
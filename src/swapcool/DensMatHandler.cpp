@@ -1,7 +1,7 @@
 #include "DensMatHandler.hpp"
 
-DensMatHandler::DensMatHandler(int kmin, int kmax):
-    nint(3), kmin(kmin), kmax(kmax) {
+DensMatHandler::DensMatHandler(int kmin, int kmax, int bandwidth):
+    nint(3), kmin(kmin), kmax(kmax), bandwidth(bandwidth) {
     if(kmin > kmax) {
         throw std::invalid_argument("Min momentum greater than max momentum.");
     }
@@ -14,24 +14,34 @@ DensMatHandler::DensMatHandler(int kmin, int kmax):
     ninc = nlinc + nrinc;
     kinc = klinc + krinc;
     
-    // Set up index maps
+    maxdk = bandwidth < 0 ?
+        kstates - 1 : std::min<int>(bandwidth, kstates - 1);
+
     // Store only the upper triangle, and also exclude the coherences with
     // the ground state
-    idxmap.reserve(3*kstates*(kstates+1)/2 + kstates*kstates);
-    idxlist.reserve(idxmap.size());
+    tri_row_start = {0};
+    coh_row_start = {0};
+    for(int kl = kmin; kl <= kmax; ++kl) {
+        tri_row_start.push_back(tri_row_start.back()
+            + std::min<int>(kmax, kl + maxdk) - kl + 1);
+        coh_row_start.push_back(coh_row_start.back()
+            + std::min<int>(kmax, kl + maxdk)
+            - std::max<int>(kmin, kl - maxdk) + 1);
+    }
+    ntri = tri_row_start.back();
+    idxlist.reserve(size());
     // On the upper triangles of the block diagonal
     for(unsigned n = 0; n < nint; ++n) {
         for(int kl = kmin; kl <= kmax; ++kl) {
-            for(int kr = kl; kr <= kmax; ++kr) {
-                idxmap[subidx(n, kl, n, kr)] = idxmap.size();
+            for(int kr = kl; kr <= std::min<int>(kmax, kl + maxdk); ++kr) {
                 idxlist.push_back({n, kl, n, kr, subidx(n, kl, n, kr)});
             }
         }
     }
     // The upper-triangular coherences between the high and low energy states
     for(int kl = kmin; kl <= kmax; ++kl) {
-        for(int kr = kmin; kr <= kmax; ++kr) {
-            idxmap[subidx(1, kl, 2, kr)] = idxmap.size();
+        for(int kr = std::max<int>(kmin, kl - maxdk);
+            kr <= std::min<int>(kmax, kl + maxdk); ++kr) {
             idxlist.push_back({1, kl, 2, kr, subidx(1, kl, 2, kr)});
         }
     }
@@ -42,66 +52,110 @@ unsigned DensMatHandler::subidx(
     return kr-kmin + kstates*(nr + nint*(kl-kmin + kstates*nl));
 }
 
+int DensMatHandler::packidx(unsigned nl, int kl, unsigned nr, int kr) const {
+    int row = kl - kmin, col = kr - kmin;
+    if(std::abs(col - row) > maxdk) return -1;
+    if(nl == nr) {
+        if(col < row) return -1;
+        return nl*ntri + tri_row_start[row] + col - row;
+    }
+    if(nl == 1 && nr == 2) {
+        return nint*ntri + coh_row_start[row]
+            + col - std::max<int>(0, row - maxdk);
+    }
+    return -1;
+}
+
+int DensMatHandler::idxpos(unsigned idx) const {
+    // Invert subidx()
+    int kr = idx % kstates + kmin;
+    idx /= kstates;
+    unsigned nr = idx % nint;
+    idx /= nint;
+    int kl = idx % kstates + kmin;
+    unsigned nl = idx / kstates;
+    return nl < nint ? packidx(nl, kl, nr, kr) : -1;
+}
+
+unsigned DensMatHandler::size() const {
+    return nint*ntri + coh_row_start.back();
+}
+
 bool DensMatHandler::has(unsigned nl, int kl, unsigned nr, int kr) const {
-    return hasidx(subidx(nl, kl, nr, kr));
+    return nl < nint && nr < nint && kl >= kmin && kl <= kmax
+        && kr >= kmin && kr <= kmax && packidx(nl, kl, nr, kr) >= 0;
 }
 bool DensMatHandler::hasidx(unsigned idx) const {
-    return (idxmap.find(idx) != idxmap.end());
+    return idxpos(idx) >= 0;
+}
+bool DensMatHandler::banded() const {
+    return maxdk < static_cast<int>(kstates) - 1;
 }
 
-std::complex<double> DensMatHandler::ele(
-    const std::vector<std::complex<double>>& rho,
+template<typename T>
+std::complex<double> DensMatHandler::ele(const std::vector<T>& rho,
     unsigned nl, int kl, unsigned nr, int kr) const {
-    return eleidx(rho, nl, kl, nr, kr, subidx(nl, kl, nr, kr));
-}
-std::complex<double> DensMatHandler::eleidx(
-    const std::vector<std::complex<double>>& rho,
-    unsigned nl, int kl, unsigned nr, int kr, unsigned idx) const {
     // Directly stored
-    if(hasidx(idx)) {
-        return atidx(rho, idx);
-    } else {
-        // Try the transpose
-        unsigned idxtrans = idxtranspose(nl, kl, nr, kr, idx);
-        if(hasidx(idxtrans)) {
-            // Density matrix must be Hermitian
-            return std::conj(atidx(rho, idxtrans));
-        }
+    int pos = packidx(nl, kl, nr, kr);
+    if(pos >= 0) {
+        return rho[pos];
+    }
+    // Try the transpose
+    pos = packidx(nr, kr, nl, kl);
+    if(pos >= 0) {
+        // Density matrix must be Hermitian
+        return std::conj(std::complex<double>(rho[pos]));
     }
     // If nothing is found, must be a 0 entry (coherence with ground state)
     return 0;
 }
-std::complex<double>& DensMatHandler::at(
-    std::vector<std::complex<double>>& rho,
+template<typename T>
+T& DensMatHandler::at(std::vector<T>& rho,
     unsigned nl, int kl, unsigned nr, int kr) const {
     return atidx(rho, subidx(nl, kl, nr, kr));
 }
-const std::complex<double>& DensMatHandler::at(
-    const std::vector<std::complex<double>>& rho,
+template<typename T>
+const T& DensMatHandler::at(const std::vector<T>& rho,
     unsigned nl, int kl, unsigned nr, int kr) const {
     return atidx(rho, subidx(nl, kl, nr, kr));
 }
-std::complex<double>& DensMatHandler::atidx(
-    std::vector<std::complex<double>>& rho, unsigned idx) const {
-    return rho[idxmap.at(idx)];
-}
-const std::complex<double>& DensMatHandler::atidx(
-    const std::vector<std::complex<double>>& rho, unsigned idx) const {
-    return rho[idxmap.at(idx)];
+template<typename T>
+T& DensMatHandler::atidx(std::vector<T>& rho, unsigned idx) const {
+    int pos = idxpos(idx);
+    if(pos < 0) {
+        throw std::out_of_range("Density matrix element is not stored.");
+    }
+    return rho[pos];
 }
-
-unsigned DensMatHandler::swapsub(int sub1, int sub2, int inc1, int inc2,
+template<typename T>
+const T& DensMatHandler::atidx(const std::vector<T>& rho,
     unsigned idx) const {
-    return idx + (inc1 - inc2)*(sub2 - sub1);
+    int pos = idxpos(idx);
+    if(pos < 0) {
+        throw std::out_of_range("Density matrix element is not stored.");
+    }
+    return rho[pos];
 }
-unsigned DensMatHandler::idxtranspose(unsigned nl, int kl, unsigned nr, int kr,
-    unsigned idx) const {
-    return swapsub(kl, kr, klinc, krinc,
-        swapsub(nl, nr, nlinc, nrinc, idx));
+
+template<typename T>
+std::vector<T> DensMatHandler::remap(const std::vector<T>& rho,
+    const DensMatHandler& from) const {
+    std::vector<T> remapped(size());
+    for(unsigned pos = 0; pos < idxlist.size(); ++pos) {
+        unsigned nl, nr;
+        int kl, kr;
+        std::tie(nl, kl, nr, kr, std::ignore) = idxlist[pos];
+        // Both handlers store the same triangle
+        if(from.has(nl, kl, nr, kr)) {
+            remapped[pos] = rho[from.packidx(nl, kl, nr, kr)];
+        }
+    }
+    return remapped;
 }
 
+template<typename T>
 std::complex<double> DensMatHandler::totaltr(
-    const std::vector<std::complex<double>>& rho_c) const {
+    const std::vector<T>& rho_c) const {
     std::complex<double> tr = 0;
     for(unsigned n = 0; n < nint; ++n) {
         for(int k = kmin; k <= kmax; ++k) {
@@ -111,8 +165,9 @@ std::complex<double> DensMatHandler::totaltr(
     return tr;
 }
 
+template<typename T>
 std::complex<double> DensMatHandler::partialtr_k(
-    const std::vector<std::complex<double>>& rho_c, unsigned n) const {
+    const std::vector<T>& rho_c, unsigned n) const {
     std::complex<double> tr = 0;
     for(int k = kmin; k <= kmax; ++k) {
         tr += ele(rho_c, n, k, n, k);
@@ -120,8 +175,9 @@ std::complex<double> DensMatHandler::partialtr_k(
     return tr;
 }
 
+template<typename T>
 std::complex<double> DensMatHandler::partialtr_n(
-    const std::vector<std::complex<double>>& rho_c, int k) const {
+    const std::vector<T>& rho_c, int k) const {
     std::complex<double> tr = 0;
     for(unsigned n = 0; n < nint; ++n) {
         tr += ele(rho_c, n, k, n, k);
@@ -129,13 +185,17 @@ std::complex<double> DensMatHandler::partialtr_n(
     return tr;
 }
 
+template<typename T>
 std::complex<double> DensMatHandler::purity(
-    const std::vector<std::complex<double>>& rho_c) const {
+    const std::vector<T>& rho_c) const {
     std::complex<double> tr = 0;
     for(unsigned nouter = 0; nouter < nint; ++nouter) {
         for(int kouter = kmin; kouter <= kmax; ++kouter) {
             for(unsigned ninner = 0; ninner < nint; ++ninner) {
-                for(int kinner = kmin; kinner <= kmax; ++kinner) {
+                // Only the band is nonzero
+                for(int kinner = std::max<int>(kmin, kouter - maxdk);
+                    kinner <= std::min<int>(kmax, kouter + maxdk);
+                    ++kinner) {
                     tr += ele(rho_c, nouter, kouter, ninner, kinner)
                         * ele(rho_c, ninner, kinner, nouter, kouter);
                 }
@@ -143,4 +203,56 @@ std::complex<double> DensMatHandler::purity(
         }
     }
     return tr;
-}
\ No newline at end of file
+}
+
+template<typename T>
+double DensMatHandler::band_edge_coherence(
+    const std::vector<T>& rho_c) const {
+    // Coherence between (nl, kl) and (nr, kr) relative to the bound
+    // sqrt(P(nl, kl)*P(nr, kr)) that it has in a density matrix
+    auto relative = [&](unsigned nl, int kl, unsigned nr, int kr) {
+        double pops = std::real(ele(rho_c, nl, kl, nl, kl))
+            * std::real(ele(rho_c, nr, kr, nr, kr));
+        return pops > 0 ?
+            std::abs(ele(rho_c, nl, kl, nr, kr))/std::sqrt(pops) : 0;
+    };
+    double max_edge = 0;
+    if(maxdk == 0) return max_edge;
+    for(int kl = kmin; kl + maxdk <= kmax; ++kl) {
+        int kr = kl + maxdk;
+        // Both sides of the band in the 1-2 block, and the upper side of
+        // the diagonal blocks
+        for(unsigned n = 0; n < nint; ++n) {
+            max_edge = std::max(max_edge, relative(n, kl, n, kr));
+        }
+        max_edge = std::max({max_edge, relative(1, kl, 2, kr),
+            relative(1, kr, 2, kl)});
+    }
+    return max_edge;
+}
+
+// Instantiations for double and single precision density matrices
+#define DENSMATHANDLER_INSTANTIATE(T) \
+    template std::complex<double> DensMatHandler::ele( \
+        const std::vector<T>&, unsigned, int, unsigned, int) const; \
+    template T& DensMatHandler::at( \
+        std::vector<T>&, unsigned, int, unsigned, int) const; \
+    template const T& DensMatHandler::at( \
+        const std::vector<T>&, unsigned, int, unsigned, int) const; \
+    template T& DensMatHandler::atidx(std::vector<T>&, unsigned) const; \
+    template const T& DensMatHandler::atidx( \
+        const std::vector<T>&, unsigned) const; \
+    template std::vector<T> DensMatHandler::remap( \
+        const std::vector<T>&, const DensMatHandler&) const; \
+    template std::complex<double> DensMatHandler::totaltr( \
+        const std::vector<T>&) const; \
+    template std::complex<double> DensMatHandler::partialtr_k( \
+        const std::vector<T>&, unsigned) const; \
+    template std::complex<double> DensMatHandler::partialtr_n( \
+        const std::vector<T>&, int) const; \
+    template std::complex<double> DensMatHandler::purity( \
+        const std::vector<T>&) const; \
+    template double DensMatHandler::band_edge_coherence( \
+        const std::vector<T>&) const;
+DENSMATHANDLER_INSTANTIATE(std::complex<double>)
+DENSMATHANDLER_INSTANTIATE(std::complex<float>)
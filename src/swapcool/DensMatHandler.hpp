@@ -1,12 +1,14 @@
 #ifndef DENSMATHANDLER_HPP_
 #define DENSMATHANDLER_HPP_
 
+#include <cmath>
 #include <complex>
+#include <cstdlib>
+#include <algorithm>
 #include <vector>
-#include <unordered_map>
 #include <utility>
 #include <tuple>
-#include <exception>
+#include <stdexcept>
 
 // Handler for dealing with an efficiently stored density matrix for the
 // 3-state SWAP system that takes advantage of hermiticity and incoherence
@@ -18,65 +20,92 @@ struct DensMatHandler {
     // linear index increments for transversing (nl, kl, nr, kr), and
     // jointly (nl & nr), (kl & kr)
     int nlinc, klinc, nrinc, krinc, ninc, kinc;
-    // Indexes of matrix elements that are actually stored
-    // The key is the linear index as determined by subidx()
-    // The value is the index of the actual density matrix vector instance
-    std::unordered_map<unsigned, unsigned> idxmap;
+    // Largest |kl - kr| of the coherences to store as requested, with a
+    // negative value for all of them, and as actually stored (at most
+    // kstates - 1)
+    int bandwidth, maxdk;
+    // Number of elements stored for each upper-triangular diagonal block
+    unsigned ntri;
+    // Position of the start of each row within an upper-triangular diagonal
+    // block, and within the 1-2 coherence block, with the total at the end
+    std::vector<unsigned> tri_row_start, coh_row_start;
     // Contains the list of matrix elements at subscript (nl, kl, nr, kr)
-    // that are actually stored. Fifth element is the linear index,
+    // that are actually stored, in storage order, so element i of the list
+    // is stored at position i. Fifth element is the linear index,
     // precomputed for speed
     std::vector<std::tuple<unsigned, int, unsigned, int, unsigned>> idxlist;
 
-    DensMatHandler(int kmin=0, int kmax=0);
+    DensMatHandler(int kmin=0, int kmax=0, int bandwidth=-1);
 
     // Convert state subscripts to linear indexes in the density matrix,
     // enumerated as |n-left, k-left><n-right, k-right|
     inline unsigned subidx(unsigned, int, unsigned, int) const;
+    // Position in the stored density matrix vector of the element at some
+    // subscript, or -1 if it isn't stored. The k values must be in range.
+    // Looked up from the row starts of the packed layout: the upper triangles
+    // of the three diagonal blocks row by row, then the 1-2 coherence block,
+    // each limited to the band |kl - kr| <= maxdk
+    int packidx(unsigned, int, unsigned, int) const;
+    // Position of the element at some linear index, or -1 if it isn't stored
+    int idxpos(unsigned) const;
+    // Number of stored elements
+    unsigned size() const;
 
     // Checks if an element at some subscript is stored
     bool has(unsigned, int, unsigned, int) const;
     // Checks if an element at some index is stored
     bool hasidx(unsigned) const;
+    // Whether coherences are dropped outside a band narrower than the matrix
+    bool banded() const;
+
+    // The element accessors and traces work on density matrices stored in
+    // either std::complex<double> or std::complex<float>. Values that are
+    // read are widened to double precision, so arithmetic on them and
+    // sums over them are carried out in double precision either way
 
     // Get the matrix element at some subscript
-    std::complex<double> ele(const std::vector<std::complex<double>>&,
+    template<typename T>
+    std::complex<double> ele(const std::vector<T>&,
         unsigned, int, unsigned, int) const;
-    // Get the matrix element with some precomputed index (for faster access)
-    std::complex<double> eleidx(const std::vector<std::complex<double>>&,
-        unsigned, int, unsigned, int, unsigned) const;
     // Get a reference to the element at some subscript
-    std::complex<double>& at(std::vector<std::complex<double>>&,
-        unsigned, int, unsigned, int) const;
-    const std::complex<double>& at(const std::vector<std::complex<double>>&,
-        unsigned, int, unsigned, int) const;
-    // Get a reference to the element at some precomputed index
-    // (for faster access)
-    std::complex<double>& atidx(std::vector<std::complex<double>>&,
-        unsigned) const;
-    const std::complex<double>& atidx(const std::vector<std::complex<double>>&,
-        unsigned) const;
-    
-    // Get the linear index after swapping two subscripts
-    // Faster than subidx()
-    unsigned swapsub(int, int, int, int, unsigned) const;
-    // Get the linear index of the transposed element
-    // Faster than subidx()
-    unsigned idxtranspose(unsigned, int, unsigned, int, unsigned) const;
+    template<typename T>
+    T& at(std::vector<T>&, unsigned, int, unsigned, int) const;
+    template<typename T>
+    const T& at(const std::vector<T>&, unsigned, int, unsigned, int) const;
+    // Get a reference to the element at some linear index. Throws
+    // std::out_of_range if it isn't stored
+    template<typename T>
+    T& atidx(std::vector<T>&, unsigned) const;
+    template<typename T>
+    const T& atidx(const std::vector<T>&, unsigned) const;
+
+    // Copy of a density matrix stored by another handler, with the elements
+    // outside its momentum range set to 0
+    template<typename T>
+    std::vector<T> remap(const std::vector<T>&, const DensMatHandler&) const;
 
     // Total trace
-    std::complex<double> totaltr(
-        const std::vector<std::complex<double>>&) const;
+    template<typename T>
+    std::complex<double> totaltr(const std::vector<T>&) const;
 
     // Partial trace over k for a fixed n
-    std::complex<double> partialtr_k(
-        const std::vector<std::complex<double>>&, unsigned) const;
+    template<typename T>
+    std::complex<double> partialtr_k(const std::vector<T>&, unsigned) const;
 
     // Partial trace over n for a fixed k
-    std::complex<double> partialtr_n(
-        const std::vector<std::complex<double>>&, int) const;
+    template<typename T>
+    std::complex<double> partialtr_n(const std::vector<T>&, int) const;
     
     // Trace of rho^2
-    std::complex<double> purity(const std::vector<std::complex<double>>&) const;
+    template<typename T>
+    std::complex<double> purity(const std::vector<T>&) const;
+
+    // Largest magnitude of the coherences on the edge of the band,
+    // |kl - kr| = maxdk, each relative to the geometric mean of the
+    // populations of the two states it couples, which bounds it. The band is
+    // too narrow unless this stays small
+    template<typename T>
+    double band_edge_coherence(const std::vector<T>&) const;
 };
 
 #endif
\ No newline at end of file
@@ -22,36 +22,17 @@ std::vector<std::complex<double>> HInt::density_matrix(
 }
 
 // Assumes row major format
-std::vector<std::complex<double>> HInt::operator()(double gt,
-    const std::vector<std::complex<double>>& rho_c) {
-    // Update/read cache
+void HInt::operator()(double gt,
+    const std::vector<std::complex<double>>& rho_c,
+    std::vector<std::complex<double>>& drho_c) {
+    // Update cache
     refresh_cache(gt);
-    double cachehalfdetun = cache[halfdetun], cachehalfrabi = cache[halfrabi];
 
-    // 1/(i*HBAR) * [H, rho_c] + L(rho_c) from the master equation
-    return {
-        (1 - branching_ratio)*rho_c[subidx(2,2)] * enable_decay,
-        1i*(cachehalfdetun*rho_c[subidx(0,1)]
-            + cachehalfrabi*rho_c[subidx(0,2)]),
-        -0.5*rho_c[subidx(0,2)] * enable_decay
-            + 1i*(-cachehalfdetun*rho_c[subidx(0,2)]
-            + cachehalfrabi*rho_c[subidx(0,1)]),
-
-        -1i*(cachehalfdetun*rho_c[subidx(1,0)]
-            + cachehalfrabi*rho_c[subidx(2,0)]),
-        branching_ratio*rho_c[subidx(2,2)] * enable_decay
-            + 1i*cachehalfrabi*(rho_c[subidx(1,2)]-rho_c[subidx(2,1)]),
-        -0.5*rho_c[subidx(1,2)] * enable_decay
-            + 1i*(cachehalfrabi*(rho_c[subidx(1,1)]-rho_c[subidx(2,2)])
-            - 2*cachehalfdetun*rho_c[subidx(1,2)]),
-        
-        -0.5*rho_c[subidx(2,0)] * enable_decay
-            + 1i*(cachehalfdetun*rho_c[subidx(2,0)]
-            - cachehalfrabi*rho_c[subidx(1,0)]),
-        -0.5*rho_c[subidx(2,1)] * enable_decay
-            - 1i*(cachehalfrabi*(rho_c[subidx(1,1)]-rho_c[subidx(2,2)])
-            - 2*cachehalfdetun*rho_c[subidx(2,1)]),
-        -rho_c[subidx(2,2)] * enable_decay
-            - 1i*cachehalfrabi*(rho_c[subidx(1,2)]-rho_c[subidx(2,1)])
-    };
+    drho_c.resize(nstates*nstates);
+    master_equation(cache[halfdetun], cache[halfrabi], branching_ratio,
+        enable_decay,
+        [&](unsigned i, unsigned j) {return rho_c[subidx(i,j)];},
+        [&](unsigned i, unsigned j) -> std::complex<double>& {
+            return drho_c[subidx(i,j)];
+        });
 }
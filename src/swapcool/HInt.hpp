@@ -7,9 +7,11 @@
 // some transition frequency, under the rotating wave approximation,
 // only paying attention to internal states
 struct HInt : public HSwap {
-    const unsigned nstates; // "matrix dimension"
+    static const unsigned nstates = 3; // "matrix dimension"
 
-    HInt(std::string fname):HSwap(fname), nstates(3) {}
+    HInt(std::string fname):HSwap(fname) {}
+    HInt(const std::unordered_map<std::string, double>& config)
+        :HSwap(config) {}
     // Convert matrix subscripts to linear indexes (row-major format)
     unsigned subidx(unsigned, unsigned) const;
 
@@ -20,8 +22,43 @@ struct HInt : public HSwap {
         double, const std::vector<std::complex<double>>&) const override;
 
     // Derivative operator to be passed to the timestepper
-    std::vector<std::complex<double>> operator()(double,
-        const std::vector<std::complex<double>>&) override;
+    using HSwap::operator();
+    void operator()(double, const std::vector<std::complex<double>>&,
+        std::vector<std::complex<double>>&) override;
+
+    // 1/(i*HBAR) * [H, rho_c] + L(rho_c) from the master equation, given
+    // half the detuning and Rabi frequency at some time. Reads elements as
+    // rho_c(i, j) and writes them to drho_c(i, j), so that batched states
+    // can share it
+    template<typename RhoFn, typename DRhoFn>
+    static void master_equation(double cachehalfdetun, double cachehalfrabi,
+        double branching_ratio, double enable_decay,
+        RhoFn&& rho_c, DRhoFn&& drho_c) {
+        using namespace std::complex_literals;
+        drho_c(0,0) = (1 - branching_ratio)*rho_c(2,2) * enable_decay;
+        drho_c(0,1) = 1i*(cachehalfdetun*rho_c(0,1)
+            + cachehalfrabi*rho_c(0,2));
+        drho_c(0,2) = -0.5*rho_c(0,2) * enable_decay
+            + 1i*(-cachehalfdetun*rho_c(0,2)
+            + cachehalfrabi*rho_c(0,1));
+
+        drho_c(1,0) = -1i*(cachehalfdetun*rho_c(1,0)
+            + cachehalfrabi*rho_c(2,0));
+        drho_c(1,1) = branching_ratio*rho_c(2,2) * enable_decay
+            + 1i*cachehalfrabi*(rho_c(1,2)-rho_c(2,1));
+        drho_c(1,2) = -0.5*rho_c(1,2) * enable_decay
+            + 1i*(cachehalfrabi*(rho_c(1,1)-rho_c(2,2))
+            - 2*cachehalfdetun*rho_c(1,2));
+
+        drho_c(2,0) = -0.5*rho_c(2,0) * enable_decay
+            + 1i*(cachehalfdetun*rho_c(2,0)
+            - cachehalfrabi*rho_c(1,0));
+        drho_c(2,1) = -0.5*rho_c(2,1) * enable_decay
+            - 1i*(cachehalfrabi*(rho_c(1,1)-rho_c(2,2))
+            - 2*cachehalfdetun*rho_c(2,1));
+        drho_c(2,2) = -rho_c(2,2) * enable_decay
+            - 1i*cachehalfrabi*(rho_c(1,2)-rho_c(2,1));
+    }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include "HIntBatch.hpp"
+
+void HIntBatch::set_lane(std::vector<std::complex<double>>& rho_c,
+    unsigned lane, const std::vector<std::complex<double>>& rho_c_lane) const {
+    rho_c.resize(HInt::nstates*HInt::nstates*lanes.size());
+    for(unsigned i = 0; i < HInt::nstates; ++i) {
+        for(unsigned j = 0; j < HInt::nstates; ++j) {
+            rho_c[batchidx(i, j, lane)] =
+                rho_c_lane[HInt::nstates*i + j];
+        }
+    }
+}
+
+std::vector<std::complex<double>> HIntBatch::get_lane(
+    const std::vector<std::complex<double>>& rho_c, unsigned lane) const {
+    std::vector<std::complex<double>> rho_c_lane(
+        HInt::nstates*HInt::nstates);
+    for(unsigned i = 0; i < HInt::nstates; ++i) {
+        for(unsigned j = 0; j < HInt::nstates; ++j) {
+            rho_c_lane[HInt::nstates*i + j] =
+                rho_c[batchidx(i, j, lane)];
+        }
+    }
+    return rho_c_lane;
+}
+
+void HIntBatch::operator()(const std::vector<double>& gt,
+    const std::vector<std::complex<double>>& rho_c,
+    std::vector<std::complex<double>>& drho_c) {
+    const unsigned nlanes = lanes.size();
+    for(unsigned lane = 0; lane < nlanes; ++lane) {
+        HInt& hamil = lanes[lane];
+        hamil.refresh_cache(gt[lane]);
+        halfdetun[lane] = hamil.cache[HSwap::halfdetun];
+        halfrabi[lane] = hamil.cache[HSwap::halfrabi];
+        branching_ratio[lane] = hamil.branching_ratio;
+        enable_decay[lane] = hamil.enable_decay;
+    }
+
+    drho_c.resize(rho_c.size());
+    for(unsigned lane = 0; lane < nlanes; ++lane) {
+        HInt::master_equation(halfdetun[lane], halfrabi[lane],
+            branching_ratio[lane], enable_decay[lane],
+            [&](unsigned i, unsigned j) {
+                return rho_c[(HInt::nstates*i + j)*nlanes + lane];
+            },
+            [&](unsigned i, unsigned j) -> std::complex<double>& {
+                return drho_c[(HInt::nstates*i + j)*nlanes + lane];
+            });
+    }
+}
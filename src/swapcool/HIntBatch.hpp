@@ -0,0 +1,40 @@
+#ifndef HINTBATCH_HPP_
+#define HINTBATCH_HPP_
+
+#include <vector>
+#include <complex>
+#include "HInt.hpp"
+
+// A batch of independent internal state systems, each with its own
+// parameters, for solving many of them side by side with a batched stepper.
+// The density matrices are stored lane-major: element (i, j) of lane l is at
+// batchidx(i, j, l)
+struct HIntBatch {
+    std::vector<HInt> lanes;
+    // Per-lane coefficients at the latest times, gathered so that the loops
+    // over lanes only read contiguous arrays
+    std::vector<double> halfdetun, halfrabi, branching_ratio, enable_decay;
+
+    // All lanes start out as copies of one system
+    HIntBatch(unsigned nlanes, const HInt& hamil):lanes(nlanes, hamil),
+        halfdetun(nlanes), halfrabi(nlanes), branching_ratio(nlanes),
+        enable_decay(nlanes) {}
+
+    unsigned batchidx(unsigned i, unsigned j, unsigned lane) const {
+        return (HInt::nstates*i + j)*lanes.size() + lane;
+    }
+
+    // Copy a lane's density matrix in or out of a batched state
+    void set_lane(std::vector<std::complex<double>>&, unsigned,
+        const std::vector<std::complex<double>>&) const;
+    std::vector<std::complex<double>> get_lane(
+        const std::vector<std::complex<double>>&, unsigned) const;
+
+    // Derivative operator to be passed to the batched timestepper, with one
+    // time per lane
+    void operator()(const std::vector<double>&,
+        const std::vector<std::complex<double>>&,
+        std::vector<std::complex<double>>&);
+};
+
+#endif
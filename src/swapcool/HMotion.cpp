@@ -4,16 +4,20 @@ using namespace std::complex_literals;
 template<typename T>
 inline T sqr(T x) {return x*x;}
 
-HMotion::HMotion(std::string fname):HSwap(fname),
-    stationary_decay_prob(0.6) {
-    double mass, init_temp, ksigmas, kmin_double, kmax_double;
-    load_params(fname,
+HMotion::HMotion(std::string fname):HMotion(read_config(fname)) {}
+
+HMotion::HMotion(const std::unordered_map<std::string, double>& config)
+    :HSwap(config), stationary_decay_prob(0.6) {
+    double mass, init_temp, ksigmas, kmin_double, kmax_double,
+        bandwidth_double;
+    load_params(config,
         {
             {"mass", &mass},
             {"initial_temperature", &init_temp},
             {"momentum_stddevs", &ksigmas},
             {"min_momentum", &kmin_double},
-            {"max_momentum", &kmax_double}
+            {"max_momentum", &kmax_double},
+            {"coherence_bandwidth", &bandwidth_double}
         }
     );
     double k_photon_per_decay = transition_angfreq_per_decay
@@ -41,79 +45,141 @@ HMotion::HMotion(std::string fname):HSwap(fname),
         ));
         kmin = -kmax;
     }
-    handler = DensMatHandler(kmin, kmax);
+    // Store all coherences by default
+    int bandwidth = std::isnan(bandwidth_double) || bandwidth_double < 1 ?
+        -1 : static_cast<int>(bandwidth_double);
+    handler = DensMatHandler(kmin, kmax, bandwidth);
+    assemble_liouvillian();
+    set_threads(1);
 }
 
-std::complex<double> HMotion::haction(
-    const std::vector<std::complex<double>>& rho_c,
-    unsigned nl, int kl, unsigned nr, int kr, int idx) const {
-    // Read from cache
-    double cachehalfdetun = cache[halfdetun], cachehalfrabi = cache[halfrabi];
-
-    std::complex<double> val = 0;
-
-    // Diagonal contribution
-    double diag_coeff = recoil_freq_per_decay*sqr(kl);
-    switch(nl) {
-        case 1: diag_coeff += cachehalfdetun; break;
-        case 2: diag_coeff -= cachehalfdetun; break;
+DerivativeThreads::DerivativeThreads(const DerivativeThreads& other)
+    :pool(new ThreadPool(1)) {
+    if(!other.row_partition.empty()) {
+        row_partition = {0, other.row_partition.back()};
     }
-    if(idx != -1) {
-        // Use precomputed index
-        val += diag_coeff*handler.atidx(rho_c, idx);
-    } else {
-        val += diag_coeff*handler.ele(rho_c, nl, kl, nr, kr);
+}
+
+DerivativeThreads& DerivativeThreads::operator=(
+    const DerivativeThreads& other) {
+    if(this != &other) {
+        *this = DerivativeThreads(other);
     }
+    return *this;
+}
 
-    // Off-diagonal contributions
-    if(nl > 0) {
-        // in rho_c, flip nl: 1 -> 2, 2 -> 1
-        unsigned nlflip = !(nl - 1) + 1;
-        if(kl - 1 >= handler.kmin) {
-            val += cachehalfrabi*handler.ele(rho_c, nlflip, kl-1, nr, kr);
+void SparseTerms::add_row(
+    const std::map<std::pair<unsigned, bool>, double>& terms) {
+    // Terms on stored elements first, then on their conjugates
+    for(bool conj: {false, true}) {
+        if(conj) {
+            conj_start.push_back(col.size());
         }
-        if(kl + 1 <= handler.kmax) {
-            val += cachehalfrabi*handler.ele(rho_c, nlflip, kl+1, nr, kr);
+        for(const auto& term: terms) {
+            if(term.first.second == conj && term.second != 0.) {
+                col.push_back(term.first.first);
+                val.push_back(term.second);
+                val_single.push_back(static_cast<float>(term.second));
+            }
         }
     }
-
-    return val;
+    row_start.push_back(col.size());
 }
 
-std::complex<double> HMotion::decayterm(
-    const std::vector<std::complex<double>>& rho_c,
-    unsigned nl, int kl, unsigned nr, int kr, unsigned idx) const {
-    // On the block diagonal
-    if(nl == nr) {
-        switch(nl) {
-            case 0:
-                return (1 - branching_ratio)
-                    * handler.ele(rho_c, 2, kl, 2, kr);
-            case 1:
-            {
-                // Approximate anisotropic dipole radiation pattern
-                std::complex<double> diprad = stationary_decay_prob
-                    * handler.ele(rho_c, 2, kl, 2, kr);
-                if(kl-1 >= handler.kmin && kr-1 >= handler.kmin) {
-                    diprad += (1-stationary_decay_prob)/2
-                        * handler.ele(rho_c, 2, kl-1, 2, kr-1);
+void HMotion::assemble_liouvillian() {
+    // Sign of the detuning energy of an internal state
+    auto detun_sign = [](unsigned n) {
+        return n == 1 ? 1. : (n == 2 ? -1. : 0.);
+    };
+    unsigned nstored = handler.size();
+    diag_const.assign(nstored, 0);
+    diag_detun.assign(nstored, 0);
+    rabi_terms = SparseTerms();
+    decay_terms = SparseTerms();
+
+    for(unsigned pos = 0; pos < nstored; ++pos) {
+        unsigned nl, nr;
+        int kl, kr;
+        std::tie(nl, kl, nr, kr, std::ignore) = handler.idxlist[pos];
+        // Row terms, keyed by the stored element they act on, and whether
+        // it's conjugated. The element at a subscript is either stored,
+        // the conjugate of a stored element, or 0, which includes the
+        // coherences outside the band
+        std::map<std::pair<unsigned, bool>, double> rabi, decay;
+        auto add = [this](decltype(rabi)& terms, double coeff,
+            unsigned nl, int kl, unsigned nr, int kr) {
+            int p = handler.packidx(nl, kl, nr, kr);
+            if(p >= 0) {
+                terms[{p, false}] += coeff;
+                return;
+            }
+            p = handler.packidx(nr, kr, nl, kl);
+            if(p >= 0) {
+                terms[{p, true}] += coeff;
+            }
+        };
+
+        // 1/(i*HBAR) * [H, rho_c] from the master equation
+        // Recoil and detuning energies are diagonal
+        diag_const[pos] = -1i*recoil_freq_per_decay
+            *static_cast<double>(sqr(kl) - sqr(kr));
+        diag_detun[pos] = -(detun_sign(nl) - detun_sign(nr));
+        // The Rabi coupling flips the internal state between 1 and 2 and
+        // changes k by one, on the left of rho_c (coefficient -i), and on
+        // the right (coefficient i)
+        if(nl > 0) {
+            unsigned nlflip = !(nl - 1) + 1;
+            for(int klnew: {kl - 1, kl + 1}) {
+                if(klnew >= handler.kmin && klnew <= handler.kmax) {
+                    add(rabi, -1, nlflip, klnew, nr, kr);
                 }
-                if(kl+1 <= handler.kmax && kr+1 <= handler.kmax) {
-                    diprad += (1-stationary_decay_prob)/2
-                        * handler.ele(rho_c, 2, kl+1, 2, kr+1);
+            }
+        }
+        if(nr > 0) {
+            unsigned nrflip = !(nr - 1) + 1;
+            for(int krnew: {kr - 1, kr + 1}) {
+                if(krnew >= handler.kmin && krnew <= handler.kmax) {
+                    add(rabi, 1, nl, kl, nrflip, krnew);
                 }
-                return branching_ratio * diprad;
             }
-            case 2: // Double decay of coherences within excited state
-                // idx is guaranteed to be stored by design
-                return -handler.atidx(rho_c, idx);
         }
-    } else if(nl == 2 || nr == 2) {
-        // Exponential decay of coherences between excited state and lower state
-        // idx is guaranteed to be stored by design
-        return -0.5*handler.atidx(rho_c, idx);
+
+        // The spontaneous decay part of the derivative (Lindblad
+        // superoperator)
+        if(nl == nr) {
+            switch(nl) {
+                case 0:
+                    add(decay, (1 - branching_ratio)*enable_decay,
+                        2, kl, 2, kr);
+                    break;
+                case 1:
+                    // Approximate anisotropic dipole radiation pattern
+                    add(decay, branching_ratio*stationary_decay_prob
+                        *enable_decay, 2, kl, 2, kr);
+                    for(int dk: {-1, 1}) {
+                        if(std::min(kl, kr) + dk >= handler.kmin
+                            && std::max(kl, kr) + dk <= handler.kmax) {
+                            add(decay, branching_ratio
+                                *(1 - stationary_decay_prob)/2*enable_decay,
+                                2, kl + dk, 2, kr + dk);
+                        }
+                    }
+                    break;
+                case 2:
+                    // Double decay of coherences within excited state
+                    diag_const[pos] -= enable_decay;
+                    break;
+            }
+        } else if(nl == 2 || nr == 2) {
+            // Exponential decay of coherences between excited state and
+            // lower state
+            diag_const[pos] -= 0.5*enable_decay;
+        }
+        rabi_terms.add_row(rabi);
+        decay_terms.add_row(decay);
     }
-    return 0;
+    diag_const_single.assign(diag_const.begin(), diag_const.end());
+    diag_detun_single.assign(diag_detun.begin(), diag_detun.end());
 }
 
 std::vector<std::complex<double>> HMotion::density_matrix(
@@ -132,33 +198,138 @@ std::vector<std::complex<double>> HMotion::density_matrix(
     }
     return rho;
 }
+std::vector<std::complex<double>> HMotion::density_matrix(
+    double gt, const std::vector<std::complex<float>>& coefficients) const {
+    return density_matrix(gt, std::vector<std::complex<double>>(
+        coefficients.begin(), coefficients.end()));
+}
 
-std::vector<std::complex<double>> HMotion::operator()(double gt,
-    const std::vector<std::complex<double>>& rho_c) {
+void HMotion::operator()(double gt,
+    const std::vector<std::complex<double>>& rho_c,
+    std::vector<std::complex<double>>& drho_c) {
+    derivative(gt, rho_c, drho_c);
+}
+void HMotion::operator()(double gt,
+    const std::vector<std::complex<float>>& rho_c,
+    std::vector<std::complex<float>>& drho_c) {
+    derivative(gt, rho_c, drho_c);
+}
+
+template<typename real>
+void HMotion::derivative(double gt,
+    const std::vector<std::complex<real>>& rho_c,
+    std::vector<std::complex<real>>& drho_c) {
     refresh_cache(gt);  // Update cache
+    const std::complex<real> idetun(0, cache[halfdetun]),
+        irabi(0, cache[halfrabi]);
+    const auto& dconst = diag_const_in(real());
+    const auto& ddetun = diag_detun_in(real());
 
-    // 1/(i*HBAR) * [H, rho_c] + L(rho_c) from the master equation
-    std::vector<std::complex<double>> drho_c(rho_c.size());
-#pragma omp parallel for
-    for(auto it = handler.idxlist.begin(); it < handler.idxlist.end(); ++it) {
-        unsigned nl, nr;
-        int kl, kr;
-        unsigned idx;
-        std::tie(nl, kl, nr, kr, idx) = *it;
-        handler.atidx(drho_c, idx) =
-            -1i*(haction(rho_c, nl, kl, nr, kr, idx)
-                 - std::conj(haction(rho_c, nr, kr, nl, kl)))
-            + decayterm(rho_c, nl, kl, nr, kr, idx) * enable_decay;
+    // 1/(i*HBAR) * [H, rho_c] + L(rho_c) from the master equation, in one
+    // pass over the assembled terms, split between the threads
+    drho_c.resize(rho_c.size());
+    const auto& row_partition = deriv_threads.row_partition;
+    deriv_threads.pool->run([&](unsigned tid) {
+        for(unsigned pos = row_partition[tid]; pos < row_partition[tid+1];
+            ++pos) {
+            drho_c[pos] = flush_subnormal(
+                (dconst[pos] + idetun*ddetun[pos])*rho_c[pos]
+                + irabi*rabi_terms.row_dot(rho_c, pos)
+                + decay_terms.row_dot(rho_c, pos));
+        }
+    });
+}
+
+void HMotion::set_threads(unsigned n_threads) {
+    deriv_threads.pool.reset(new ThreadPool(n_threads));
+    partition_rows();
+}
+
+void HMotion::partition_rows() {
+    // Split the rows where the running count of terms, plus one for the
+    // diagonal, passes each thread's share
+    unsigned nstored = handler.size();
+    auto cost_before = [this](unsigned pos) {
+        return static_cast<unsigned long>(pos) + rabi_terms.row_start[pos]
+            + decay_terms.row_start[pos];
+    };
+    unsigned long total = cost_before(nstored);
+    unsigned nthreads = threads();
+    auto& row_partition = deriv_threads.row_partition;
+    row_partition.assign(nthreads + 1, 0);
+    unsigned pos = 0;
+    for(unsigned tid = 1; tid < nthreads; ++tid) {
+        while(pos < nstored && cost_before(pos)*nthreads < total*tid) {
+            ++pos;
+        }
+        row_partition[tid] = pos;
+    }
+    row_partition.back() = nstored;
+}
+
+unsigned HMotion::threads() const {
+    return deriv_threads.pool->size();
+}
+
+void HMotion::set_momentum_range(int kmin, int kmax) {
+    handler = DensMatHandler(kmin, kmax, handler.bandwidth);
+    assemble_liouvillian();
+    partition_rows();
+}
+
+template<typename real>
+std::vector<std::complex<real>> HMotion::recoil_diagonal() const {
+    std::vector<std::complex<real>> diag(handler.size());
+    for(unsigned pos = 0; pos < diag.size(); ++pos) {
+        int kl = std::get<1>(handler.idxlist[pos]);
+        int kr = std::get<3>(handler.idxlist[pos]);
+        diag[pos] = static_cast<std::complex<real>>(
+            -1i*recoil_freq_per_decay*static_cast<double>(sqr(kl) - sqr(kr)));
     }
-    return drho_c;
+    return diag;
 }
 
-void HMotion::initialize_cycle(std::vector<std::complex<double>>& rho) const {
+timestepping::inplace::LoopParts HMotion::loop_parts() const {
+    timestepping::inplace::LoopParts parts;
+    const DerivativeThreads& threads = deriv_threads;
+    if(threads.pool->size() == 1) return parts;
+    parts.parts = threads.pool->size();
+    parts.run = [&threads](unsigned n,
+        const std::function<void(unsigned, unsigned, unsigned)>& body) {
+        const auto& bounds = threads.row_partition;
+        // Vectors of another size aren't split
+        if(n != bounds.back()) {
+            body(0, 0, n);
+            return;
+        }
+        threads.pool->run([&](unsigned tid) {
+            body(tid, bounds[tid], bounds[tid+1]);
+        });
+    };
+    return parts;
+}
+
+template<typename T>
+void HMotion::jacobian_diagonal(double gt, std::vector<T>& diag) {
+    refresh_cache(gt);
+    // Only the diagonal parts act on an element itself
+    diag.resize(handler.size());
+    for(unsigned pos = 0; pos < diag.size(); ++pos) {
+        diag[pos] = static_cast<T>(diag_const[pos]
+            + 1i*cache[halfdetun]*diag_detun[pos]);
+    }
+}
+
+template<typename T>
+void HMotion::initialize_cycle(std::vector<T>& rho) const {
     // Only run decays if they're enabled
     if(!enable_decay) return;
 
+    // Every element read or written below has the same kl - kr as the
+    // excited state element it comes from, so only the band is visited
     for(int kl = handler.kmin; kl <= handler.kmax; ++kl) {
-        for(int kr = handler.kmin; kr <= handler.kmax; ++kr) {
+        for(int kr = std::max(handler.kmin, kl - handler.maxdk);
+            kr <= std::min(handler.kmax, kl + handler.maxdk); ++kr) {
             // Excited state population and intra-excited-state coherences
             // distribute between the lower energy states
             if(handler.has(0, kl, 0, kr)) {
@@ -196,4 +367,15 @@ void HMotion::initialize_cycle(std::vector<std::complex<double>>& rho) const {
         }
     }
     return;
-}
\ No newline at end of file
+}
+
+// Instantiations for double and single precision density matrices
+#define HMOTION_INSTANTIATE(real) \
+    template std::vector<std::complex<real>> \
+        HMotion::recoil_diagonal<real>() const; \
+    template void HMotion::jacobian_diagonal( \
+        double, std::vector<std::complex<real>>&); \
+    template void HMotion::initialize_cycle( \
+        std::vector<std::complex<real>>&) const;
+HMOTION_INSTANTIATE(double)
+HMOTION_INSTANTIATE(float)
@@ -1,13 +1,79 @@
 #ifndef HMOTION_HPP_
 #define HMOTION_HPP_
 
-#ifdef _OPENMP
-#include <omp.h>
-#endif
-
+#include <limits>
+#include <map>
+#include <memory>
+#include <utility>
 #include "HSwap.hpp"
 #include "DensMatHandler.hpp"
 #include "lasercool/fundconst.hpp"
+#include "lasercool/threadpool.hpp"
+#include "lasercool/timestepping.hpp"
+
+// Sparse matrix with real coefficients in compressed sparse row format,
+// acting on a density matrix stored as one triangle. Elements of the other
+// triangle are conjugates of stored ones, so a term acts either on a stored
+// element or on its conjugate, and the map is only linear over the reals.
+// The terms of row i that act on stored elements are
+// [row_start[i], conj_start[i]), and those that act on their conjugates are
+// [conj_start[i], row_start[i+1])
+struct SparseTerms {
+    std::vector<unsigned> row_start = {0}, conj_start, col;
+    // Coefficients, with a single precision copy for single precision
+    // density matrices
+    std::vector<double> val;
+    std::vector<float> val_single;
+
+    // Append a row, given as (column, whether it's conjugated) -> coefficient
+    void add_row(const std::map<std::pair<unsigned, bool>, double>&);
+
+    // The coefficients in the given precision
+    const std::vector<double>& coefficients(double) const {return val;}
+    const std::vector<float>& coefficients(float) const {return val_single;}
+
+    // Row i of the product with rho, in the precision of rho
+    template<typename real>
+    std::complex<real> row_dot(const std::vector<std::complex<real>>& rho,
+        unsigned i) const {
+        const std::vector<real>& v = coefficients(real());
+        std::complex<real> sum = 0;
+        for(unsigned j = row_start[i]; j < conj_start[i]; ++j) {
+            sum += v[j]*rho[col[j]];
+        }
+        for(unsigned j = conj_start[i]; j < row_start[i+1]; ++j) {
+            sum += v[j]*std::conj(rho[col[j]]);
+        }
+        return sum;
+    }
+};
+
+// Zero the parts of a single precision value too small to be normal.
+// Populations far out in the momentum tails underflow to subnormal floats,
+// which are many times slower to compute with. Doubles are left alone
+inline std::complex<float> flush_subnormal(std::complex<float> z) {
+    const float tiny = std::numeric_limits<float>::min();
+    return {std::abs(z.real()) < tiny ? 0.f : z.real(),
+        std::abs(z.imag()) < tiny ? 0.f : z.imag()};
+}
+inline std::complex<double> flush_subnormal(std::complex<double> z) {
+    return z;
+}
+
+// Persistent threads computing a derivative, and the range of stored
+// elements [row_partition[i], row_partition[i+1]) that thread i computes.
+// ThreadPool::run() isn't reentrant, so copies don't share the threads. A
+// copy computes the derivative on the calling thread alone
+struct DerivativeThreads {
+    std::unique_ptr<ThreadPool> pool;
+    std::vector<unsigned> row_partition;
+
+    DerivativeThreads() = default;
+    DerivativeThreads(const DerivativeThreads&);
+    DerivativeThreads& operator=(const DerivativeThreads&);
+    DerivativeThreads(DerivativeThreads&&) = default;
+    DerivativeThreads& operator=(DerivativeThreads&&) = default;
+};
 
 // Hamiltonian for sawtooth laser frequency oscillating about
 // some transition frequency, under the rotating wave approximation,
@@ -17,32 +83,99 @@ struct HMotion : public HSwap {
     double stationary_decay_prob;
     double recoil_freq_per_decay;
     DensMatHandler handler;
+    // The derivative is assembled at construction, split by time dependence
+    // of the coefficients, as
+    // diag_const*rho + i*halfdetun(t)*diag_detun*rho
+    //     + i*halfrabi(t)*rabi_terms(rho) + decay_terms(rho)
+    // with the diagonal parts stored separately. The coefficients of the
+    // detuning and Rabi parts are all imaginary, so they are stored divided
+    // by i. Changing the parameters above afterwards doesn't change the
+    // derivative
+    std::vector<std::complex<double>> diag_const;
+    std::vector<double> diag_detun;
+    // Single precision copies, for single precision density matrices
+    std::vector<std::complex<float>> diag_const_single;
+    std::vector<float> diag_detun_single;
+    SparseTerms rabi_terms, decay_terms;
+    // Threads for the derivative. The ranges of elements hold equal numbers
+    // of terms rather than of elements
+    DerivativeThreads deriv_threads;
 
     HMotion(std::string);
+    // From name-value pairs already read from a config file
+    HMotion(const std::unordered_map<std::string, double>&);
 
-    // The action of the Hamiltonian on the density matrix, returns a single
-    // component of H*rho
-    // Optionally provide a precomputed stored index for speed
-    // -1 means no index is provided
-    std::complex<double> haction(const std::vector<std::complex<double>>&,
-        unsigned, int, unsigned, int, int idx=-1) const;
-    
-    // The spontaneous decay part of the derivative (Lindblad superoperator)
-    std::complex<double> decayterm(const std::vector<std::complex<double>>&,
-        unsigned, int, unsigned, int, unsigned) const;
+    // The member functions taking a density matrix accept it in
+    // std::complex<double> or std::complex<float>, so it can be stored in
+    // single precision. The derivative is computed in the precision of the
+    // density matrix
 
     // Transforms the coefficients solved for in the rotating wave
     // approximation back to the actual density matrix values;
     // i.e. put the oscillation back in.
     std::vector<std::complex<double>> density_matrix(
         double, const std::vector<std::complex<double>>&) const override;
+    std::vector<std::complex<double>> density_matrix(
+        double, const std::vector<std::complex<float>>&) const;
 
     // Derivative operator to be passed to the timestepper
-    std::vector<std::complex<double>> operator()(double,
-        const std::vector<std::complex<double>>&) override;
+    using HSwap::operator();
+    void operator()(double, const std::vector<std::complex<double>>&,
+        std::vector<std::complex<double>>&) override;
+    void operator()(double, const std::vector<std::complex<float>>&,
+        std::vector<std::complex<float>>&);
+
+    // The recoil (kinetic energy) part of the derivative, -i*[H_recoil, rho],
+    // which is diagonal and constant in time. Its elements grow as k^2, so
+    // it can be integrated exactly with an integrating factor
+    template<typename real=double>
+    std::vector<std::complex<real>> recoil_diagonal() const;
+
+    // Diagonal of the Jacobian of the derivative at time gt, i.e. the
+    // coefficient of each element in its own derivative
+    template<typename T>
+    void jacobian_diagonal(double gt, std::vector<T>&);
+
+    // Number of threads computing the derivative, with 0 for one per
+    // hardware thread. Defaults to 1
+    void set_threads(unsigned);
+    unsigned threads() const;
+    // Splits a stepper's loops over the stored elements like the
+    // derivative, on the same threads. Copies, with a single thread, run
+    // them whole
+    timestepping::inplace::LoopParts loop_parts() const;
+
+    // Track a new momentum range, with the same coherence bandwidth,
+    // reassembling the derivative. Density matrices for the old range must
+    // be remapped with handler.remap()
+    void set_momentum_range(int, int);
 
     // Modify the density matrix in preparation for a new cycle
-    void initialize_cycle(std::vector<std::complex<double>>&) const;
+    template<typename T>
+    void initialize_cycle(std::vector<T>&) const;
+
+    private:
+        // Fill in the split derivative, once the parameters are loaded
+        void assemble_liouvillian();
+        // Split the stored elements between the threads
+        void partition_rows();
+        // Derivative at either precision
+        template<typename real>
+        void derivative(double, const std::vector<std::complex<real>>&,
+            std::vector<std::complex<real>>&);
+        // The diagonal coefficients in the given precision
+        const std::vector<std::complex<double>>& diag_const_in(double) const {
+            return diag_const;
+        }
+        const std::vector<std::complex<float>>& diag_const_in(float) const {
+            return diag_const_single;
+        }
+        const std::vector<double>& diag_detun_in(double) const {
+            return diag_detun;
+        }
+        const std::vector<float>& diag_detun_in(float) const {
+            return diag_detun_single;
+        }
 };
 
 #endif
\ No newline at end of file
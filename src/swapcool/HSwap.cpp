@@ -1,9 +1,10 @@
 #include "HSwap.hpp"
 
-HSwap::HSwap(std::string fname)
-    : cache({0, 0.5*detun_per_decay(0), 0.5*rabi_softswitch(0)}) {
+HSwap::HSwap(std::string fname):HSwap(read_config(fname)) {}
+
+HSwap::HSwap(const std::unordered_map<std::string, double>& config) {
     double low_energy, high_energy;
-    load_params(fname,
+    load_params(config,
         {
             {"spontaneous_decay_rate", &decay_rate},
             {"enable_decay", &enable_decay},
@@ -19,6 +20,8 @@ HSwap::HSwap(std::string fname)
     );
     transition_angfreq_per_decay = (high_energy - low_energy)
         /(fundamental_constants::HBAR*decay_rate);
+    // Only fill the cache once the parameters it depends on are loaded
+    cache = {0, 0.5*detun_per_decay(0), 0.5*rabi_softswitch(0)};
 }
 
 double HSwap::rabi_softswitch(double gt) const {
@@ -50,3 +53,10 @@ void HSwap::refresh_cache(double gt) {
         cache[halfrabi] = 0.5*rabi_softswitch(gt);
     }
 }
+
+std::vector<std::complex<double>> HSwap::operator()(double gt,
+    const std::vector<std::complex<double>>& rho_c) {
+    std::vector<std::complex<double>> drho_c;
+    (*this)(gt, rho_c, drho_c);
+    return drho_c;
+}
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <complex>
+#include <unordered_map>
 #include "lasercool/readcfg.hpp"
 #include "lasercool/fundconst.hpp"
 
@@ -24,6 +25,8 @@ struct HSwap{
     enum cache_key {cachetime, halfdetun, halfrabi};
 
     HSwap(std::string);
+    // From name-value pairs already read from a config file
+    HSwap(const std::unordered_map<std::string, double>&);
 
     // Rabi frequency soft switch on/off at a given (decay rate)*time
     // starting from 0 at gamma*t = 0 (mod gamma/f)
@@ -45,8 +48,12 @@ struct HSwap{
         double, const std::vector<std::complex<double>>&) const = 0;
 
     // Derivative operator to be passed to the timestepper
-    virtual std::vector<std::complex<double>> operator()(double,
-        const std::vector<std::complex<double>>&) = 0;
+    std::vector<std::complex<double>> operator()(double,
+        const std::vector<std::complex<double>>&);
+    // In-place derivative operator, for the in-place timesteppers.
+    // Overwrites the last argument, resizing it to match the density matrix
+    virtual void operator()(double, const std::vector<std::complex<double>>&,
+        std::vector<std::complex<double>>&) = 0;
 };
 
 #endif
\ No newline at end of file
@@ -6,7 +6,10 @@ const std::string DEFAULT_CFG_FILE = "config/params_swapcool.cfg";
 const std::string DEFAULT_OUTPUT_DIR = "output/swapcool/swapint";
 const std::string RHO_OUTFILEBASE = "rho.out";
 const std::string CYCLE_OUTFILEBASE = "cycles.out";
+const std::string SWEEP_OUTFILEBASE = "sweep.out";
 const unsigned OUTFILENAME_PRECISION = 3;
+// Number of systems each thread solves side by side in a parameter sweep
+const unsigned SWEEP_LANES = 8;
 
 int main(int argc, char** argv) {
     // Parse the program name to find the project root directory
@@ -15,30 +18,57 @@ int main(int argc, char** argv) {
     // The program binary will be in project/bin, assuming no symlinks
     std::string projrootdir = progdir + "/..";
 
-    if(argc > 3) {
+    // Separate out a possible sweep file from the positional arguments
+    std::vector<std::string> args;
+    std::string sweep_file;
+    bool bad_args = false;
+    for(int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if(arg == "--sweep") {
+            if(++i < argc) {
+                sweep_file = argv[i];
+            } else {
+                bad_args = true;
+            }
+        } else {
+            args.push_back(arg);
+        }
+    }
+    if(bad_args || args.size() > 2) {
         std::cout << "Usage: " << progname
-            << " [<output directory>] [<config file>]"
+            << " [<output directory>] [<config file>] [--sweep <sweep file>]"
             << std::endl;
         return 1;
     }
     // Read in a possible output directory
     std::string output_dir = fullfile(DEFAULT_OUTPUT_DIR, projrootdir);
-    if(argc > 1) {
-        output_dir = std::string(argv[1]);
+    if(args.size() > 0) {
+        output_dir = args[0];
     }
     // Read in a possible config file
     std::string cfg_file = fullfile(DEFAULT_CFG_FILE, projrootdir);
-    if(argc > 2) {
-        cfg_file = std::string(argv[2]);
+    if(args.size() > 1) {
+        cfg_file = args[1];
     }
 
-    double duration_by_decay, tol;
+    if(!sweep_file.empty()) {
+        run_sweep(read_config(cfg_file), sweep_file, output_dir);
+        return 0;
+    }
+
+    double duration_by_decay, tol, stepper_double, pi_beta;
     load_params(cfg_file,
         {
             {"duration", &duration_by_decay},
-            {"tolerance", &tol}
+            {"tolerance", &tol},
+            {"stepper", &stepper_double},
+            {"pi_beta", &pi_beta}
         }
     );
+    auto scheme = timestepping::inplace::to_adaptive_scheme(stepper_double);
+    if(std::isnan(pi_beta)) {
+        pi_beta = 0;
+    }
 
     // Form the derivative operator, in natural units
     // d(rho)/d(Gamma*t)
@@ -75,8 +105,16 @@ int main(int argc, char** argv) {
     };
 
     // Solve the system in natural units with an adaptive RK method
-    auto rho_c_solution = timestepping::odesolve(hamil, rho_c0,
-        duration_by_decay, timestepping::AdaptiveRK(tol));
+    timestepping::inplace::AdaptiveOptions<std::complex<double>> stepper_opts;
+    stepper_opts.scheme = scheme;
+    stepper_opts.tol = tol;
+    stepper_opts.pi_beta = pi_beta;
+    stepper_opts.linear = true;
+    auto rho_c_solution = timestepping::inplace::with_adaptive_stepper(
+        stepper_opts, [&](auto& stepper) {
+            return timestepping::inplace::odesolve(hamil, rho_c0,
+                duration_by_decay, stepper);
+        });
 
     // Write the solution in SI units, putting back in the rotating wave
     // oscillation
@@ -95,3 +133,142 @@ int main(int argc, char** argv) {
     }
     rho_out.close();
 }
+
+void run_sweep(const std::unordered_map<std::string, double>& base_config,
+    std::string sweep_file, std::string output_dir) {
+    auto sweep = read_sweep(sweep_file);
+    // Points are the Cartesian product of all the swept values, with the
+    // last parameter in the file varying fastest
+    unsigned long n_points = 1;
+    for(const auto& param: sweep) {
+        n_points *= param.second.size();
+    }
+    // The stepper settings are shared by all the points
+    double tol, pi_beta, threads_double;
+    load_params(base_config,
+        {
+            {"tolerance", &tol},
+            {"pi_beta", &pi_beta},
+            {"threads", &threads_double}
+        }
+    );
+    if(std::isnan(pi_beta)) {
+        pi_beta = 0;
+    }
+    unsigned n_threads = std::isnan(threads_double) ?
+        1 : static_cast<unsigned>(threads_double);
+    std::cout << "Sweeping " << sweep.size() << " parameters over "
+        << n_points << " points" << std::endl;
+
+    // Point k has the values given by writing k in mixed radix
+    auto point_values = [&](unsigned long k) {
+        std::vector<double> values(sweep.size());
+        for(unsigned j = sweep.size(); j-- > 0; ) {
+            values[j] = sweep[j].second[k % sweep[j].second.size()];
+            k /= sweep[j].second.size();
+        }
+        return values;
+    };
+
+    // All in the ground state
+    std::vector<std::complex<double>> rho_c0{
+        0, 0, 0,
+        0, 1, 0,
+        0, 0, 0,
+    };
+
+    // Every thread solves a batch of points side by side with the
+    // Dormand-Prince scheme, and takes the next unclaimed point into a lane
+    // as soon as the point in it finishes, so lanes stay busy even though
+    // the points take different numbers of steps
+    std::vector<std::vector<double>> results(n_points);
+    std::atomic<unsigned long> next_point(0);
+    timestepping::inplace::StepStats step_stats;
+    std::mutex stats_mtx;
+    ThreadPool pool(n_threads);
+    auto start = std::chrono::system_clock::now();
+    pool.run([&](unsigned) {
+        HIntBatch batch(SWEEP_LANES, HInt(base_config));
+        timestepping::inplace::BatchDormandPrince<std::complex<double>>
+            stepper(SWEEP_LANES, tol, 1e-3, 0.9, 4, 100, pi_beta);
+        std::vector<std::complex<double>> rho_c;
+        std::vector<double> gt(SWEEP_LANES, 0), gt_final(SWEEP_LANES, 0);
+        // Point in each lane, or n_points for an idle lane
+        std::vector<unsigned long> lane_point(SWEEP_LANES, n_points);
+
+        auto claim_point = [&](unsigned lane) {
+            unsigned long k = next_point++;
+            gt[lane] = 0;
+            gt_final[lane] = 0;
+            lane_point[lane] = std::min(k, n_points);
+            if(k >= n_points) return;
+
+            auto config = base_config;
+            auto values = point_values(k);
+            for(unsigned j = 0; j < sweep.size(); ++j) {
+                config[sweep[j].first] = values[j];
+            }
+            batch.lanes[lane] = HInt(config);
+            gt_final[lane] = config["duration"];
+            batch.set_lane(rho_c, lane, rho_c0);
+            stepper.reset_lane(lane);
+        };
+        for(unsigned lane = 0; lane < SWEEP_LANES; ++lane) {
+            claim_point(lane);
+        }
+
+        while(true) {
+            bool busy = false;
+            for(unsigned lane = 0; lane < SWEEP_LANES; ++lane) {
+                if(lane_point[lane] < n_points
+                    && gt[lane] >= gt_final[lane]) {
+                    // Record the final populations, and refill the lane
+                    auto rho = batch.lanes[lane].density_matrix(gt[lane],
+                        batch.get_lane(rho_c, lane));
+                    const HInt& hamil = batch.lanes[lane];
+                    results[lane_point[lane]] = {
+                        std::real(rho[hamil.subidx(0,0)]),
+                        std::real(rho[hamil.subidx(1,1)]),
+                        std::real(rho[hamil.subidx(2,2)])
+                    };
+                    claim_point(lane);
+                }
+                busy = busy || lane_point[lane] < n_points;
+            }
+            if(!busy) break;
+            stepper.step(gt, rho_c, gt_final, batch);
+        }
+
+        std::lock_guard<std::mutex> lock(stats_mtx);
+        step_stats += stepper.stats();
+    });
+    std::chrono::duration<double> total_seconds =
+        std::chrono::system_clock::now() - start;
+    std::cout << "Simulation time: " << total_seconds.count() << " s"
+        << " (" << pool.size() << " threads, " << SWEEP_LANES
+        << " lanes each)" << std::endl
+        << "Steps: " << step_stats.accepted << " accepted, "
+        << step_stats.rejected << " rejected" << std::endl;
+
+    // Consolidated results table, named after the sweep file
+    std::string sweep_name = sweep_file.substr(sweep_file.rfind('/') + 1);
+    sweep_name = sweep_name.substr(0, sweep_name.rfind('.'));
+    std::ofstream outfile(fullfile(tag_filename(SWEEP_OUTFILEBASE, sweep_name),
+        output_dir));
+    if(!outfile) {
+        throw std::runtime_error("Could not open sweep output file");
+    }
+    outfile << std::setprecision(std::numeric_limits<double>::max_digits10);
+    outfile << "#";
+    for(const auto& param: sweep) {
+        outfile << " " << param.first;
+    }
+    outfile << " rho11 rho22 rho33" << std::endl;
+    for(unsigned long k = 0; k < n_points; ++k) {
+        for(double value: point_values(k)) {
+            outfile << value << " ";
+        }
+        outfile << results[k][0] << " " << results[k][1] << " "
+            << results[k][2] << std::endl;
+    }
+}
@@ -3,12 +3,29 @@
 
 #include <cmath>
 #include <iomanip>
+#include <iostream>
 #include <string>
 #include <fstream>
 #include <complex>
+#include <vector>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
 #include "HInt.hpp"
+#include "HIntBatch.hpp"
 #include "lasercool/readcfg.hpp"
 #include "lasercool/iotag.hpp"
 #include "lasercool/timestepping.hpp"
+#include "lasercool/threadpool.hpp"
+
+// Solve the system for every point of a parameter sweep, on top of the base
+// config values, and write the final populations of all the points to one
+// table
+void run_sweep(const std::unordered_map<std::string, double>&, std::string,
+    std::string);
 
 #endif
\ No newline at end of file
@@ -8,10 +8,10 @@ const std::string DEFAULT_OUTPUT_DIR = "output/swapcool/swapmotion";
 const std::string RHO_OUTFILEBASE = "rho.out";
 const std::string KDIST_OUTFILEBASE = "kdist.out";
 const std::string KDIST_FINAL_OUTFILEBASE = "kdist_final.out";
-// Approximate number of solution points to output per sawtooth cycle.
-// Only approximate because adaptive time steps make it hard to divide things
-// exactly
-const double APPROX_OUTPUT_PTS_PER_CYCLE = 100;
+const std::string DRIFT_OUTFILEBASE = "precision_drift.out";
+// Number of solution points to output per sawtooth cycle, interpolated
+// between the adaptive time steps
+const double OUTPUT_PTS_PER_CYCLE = 100;
 const unsigned OUTFILENAME_PRECISION = 3;
 
 int main(int argc, char** argv) {
@@ -51,15 +51,60 @@ int main(int argc, char** argv) {
         }
     }
 
-    double duration_by_decay, tol, init_temp, init_k_double;
+    double duration_by_decay, tol, stepper_double, pi_beta, init_temp,
+        init_k_double, threads_double, parareal_window_double,
+        single_precision_double, validate_precision_double,
+        adaptive_k_threshold, adaptive_k_margin_double, adaptive_k_max_double;
+    PararealOptions parareal_opts;
     load_params(cfg_file,
         {
             {"duration", &duration_by_decay},
             {"tolerance", &tol},
+            {"stepper", &stepper_double},
+            {"pi_beta", &pi_beta},
             {"initial_temperature", &init_temp},
-            {"initial_momentum", &init_k_double}
+            {"initial_momentum", &init_k_double},
+            {"threads", &threads_double},
+            {"parareal_coarse_tolerance", &parareal_opts.coarse_tol},
+            {"parareal_tolerance", &parareal_opts.tol},
+            {"parareal_window", &parareal_window_double},
+            {"single_precision", &single_precision_double},
+            {"validate_precision", &validate_precision_double},
+            {"adaptive_momentum_threshold", &adaptive_k_threshold},
+            {"adaptive_momentum_margin", &adaptive_k_margin_double},
+            {"adaptive_momentum_max", &adaptive_k_max_double}
         }
     );
+    auto scheme = timestepping::inplace::to_adaptive_scheme(stepper_double);
+    if(std::isnan(pi_beta)) {
+        pi_beta = 0;
+    }
+    // Parareal is off unless a coarse tolerance is given
+    bool use_parareal = !std::isnan(parareal_opts.coarse_tol)
+        && parareal_opts.coarse_tol > 0;
+    if(std::isnan(parareal_opts.tol) || parareal_opts.tol <= 0) {
+        parareal_opts.tol = tol;
+    }
+    parareal_opts.window = std::isnan(parareal_window_double) ?
+        0 : static_cast<unsigned>(parareal_window_double);
+    bool single_precision = !std::isnan(single_precision_double)
+        && single_precision_double != 0;
+    // The double precision reference is solved cycle by cycle alongside
+    bool validate_precision = single_precision
+        && !std::isnan(validate_precision_double)
+        && validate_precision_double != 0;
+    if(validate_precision) {
+        use_parareal = false;
+    }
+    // The momentum range can only change between cycles solved one by one
+    bool adaptive_k = !std::isnan(adaptive_k_threshold)
+        && adaptive_k_threshold > 0;
+    int adaptive_k_margin = std::isnan(adaptive_k_margin_double)
+        || adaptive_k_margin_double < 1 ?
+        10 : static_cast<int>(adaptive_k_margin_double);
+    if(adaptive_k) {
+        use_parareal = false;
+    }
     bool is_thermal = true;
     int init_k;
     if(!std::isnan(init_k_double)) {
@@ -71,6 +116,21 @@ int main(int argc, char** argv) {
     // Form the derivative operator, in natural units
     // d(rho)/d(Gamma*t)
     HMotion hamil(cfg_file);
+    // Parareal solves the cycles on these threads, and its sequential
+    // coarse solves use them for the derivative
+    hamil.set_threads(std::isnan(threads_double) ?
+        1 : static_cast<unsigned>(threads_double));
+
+    // Largest |k| the range can grow to, which is also the fixed grid of the
+    // k-distribution output, so that it has the same rows at every time
+    int kdist_kmax = -1;
+    if(adaptive_k) {
+        int init_kmax = std::max(-hamil.handler.kmin, hamil.handler.kmax);
+        kdist_kmax = std::isnan(adaptive_k_max_double)
+            || adaptive_k_max_double < 1 ?
+            2*init_kmax : std::max(init_kmax,
+                static_cast<int>(adaptive_k_max_double));
+    }
 
     // Initialize state
     std::vector<std::complex<double>> rho_c;
@@ -79,14 +139,14 @@ int main(int argc, char** argv) {
         rho_c = thermal_state(init_temp, hamil);
     } else {
         // Initialize all in one k-state
-        rho_c.resize(hamil.handler.idxmap.size());
+        rho_c.resize(hamil.handler.size());
         hamil.handler.at(rho_c, 1, init_k, 1, init_k) = 1;
     }
 
     // Print out stuff if not in batch mode
     if(!batchmode) {
         print_system_info(rho_c, hamil, init_temp, init_k, is_thermal,
-            duration_by_decay, tol);
+            duration_by_decay, tol, scheme, pi_beta);
     }
 
     // Form output files
@@ -132,63 +192,129 @@ int main(int argc, char** argv) {
     int nfullcycles = static_cast<int>(nfullcycles_double);
     bool has_partial_cycle = (cycle_remain != 0);
 
-    // Approximate gamma*dt between output points
-    double output_gdt = 1. /
-        (APPROX_OUTPUT_PTS_PER_CYCLE * hamil.detun_freq_per_decay);
-    // For holding the time of the popped final entry of the solution,
+    // For holding the time of the final state of the solution,
     // to be used after loop termination
     double solution_endgt = 0;
-    // Solve cycle-by-cycle. Add an extra iteration if a partial cycle is
-    // necessary
+    // Solver statistics over all cycles
+    timestepping::inplace::StepStats step_stats;
+    PararealStats parareal_stats;
+    // Largest differences from the double precision solution in validation
+    // mode
+    double max_trace_drift = 0, max_purity_drift = 0;
+    unsigned k_resizes = 0;
+    // Largest relative coherence on the edge of the band at the cycle
+    // boundaries, when the coherences are banded
+    double max_band_edge = 0;
 
     /// TIMING
     auto start = std::chrono::system_clock::now();
     ///
 
-    for(int cycle = 0; cycle < nfullcycles + has_partial_cycle; ++cycle) {
-        if(!batchmode) {
-            std::cout << "\rProgress: running cycle " << cycle + 1
-                << "/" << nfullcycles + has_partial_cycle << std::flush;
+    // Solve with the density matrix stored at the precision of the type of
+    // the argument. rho_c is converted back to double precision at the end
+    auto solve = [&](auto precision) {
+        typedef decltype(precision) real;
+        auto stepper_opts = stepper_options<real>(hamil, scheme, tol, pi_beta);
+        std::vector<std::complex<real>> rho(rho_c.size());
+        for(unsigned pos = 0; pos < rho.size(); ++pos) {
+            rho[pos] = flush_subnormal(std::complex<real>(rho_c[pos]));
         }
-
-        // Determine the final local cycle time to solve until
-        double endtime = std::min(
-            duration_by_decay, (cycle+1)/hamil.detun_freq_per_decay)
-            - cycle/hamil.detun_freq_per_decay;
-        
-        // Prepare the density matrix for a new cycle
-        hamil.initialize_cycle(rho_c);
-        // Solve a full/partial system cycle in natural units with adaptive RK
-        auto rho_c_solution = timestepping::odesolve(hamil, rho_c,
-            endtime, timestepping::AdaptiveRK(tol));
-
-        // Save the final rho_c for the next cycle        
-        std::tie(solution_endgt, rho_c) = rho_c_solution.back();
-        solution_endgt += cycle/hamil.detun_freq_per_decay;
-        // Don't write the final state to file, since it'll be modified and
-        // included in the next iteration, or written after loop exit
-        rho_c_solution.pop_back();
-        
-        // Write the solution to file
-        int cur_steps = -1; // Effective number of output steps taken so far
-        for(auto point: rho_c_solution) {
-            // Get the actual, global time
-            double gt = point.first + cycle/hamil.detun_freq_per_decay;
-            double time = gt / hamil.decay_rate;
-
-            // Get the effective number of output time steps taken so far
-            int cur_steps_new = static_cast<int>(gt / output_gdt);
-            // Only record output if time has advanced by at least the minimum
-            // specified time between outputs
-            if(cur_steps_new > cur_steps) {
-                // Record the new number of output time steps taken
-                cur_steps = cur_steps_new;
-
-                auto rho = hamil.density_matrix(gt, point.second);
-                write_state_info(rho_out, time, rho, hamil.handler);
-                write_kdist(kdistout, time, rho, hamil.handler);
+        double endgt = 0;
+        if(use_parareal) {
+            // Solve the cycles in parallel, and correct them iteratively
+            endgt = run_parareal(hamil, rho, duration_by_decay,
+                stepper_opts, parareal_opts, rho_out, kdistout,
+                parareal_stats, batchmode);
+            step_stats = parareal_stats.fine;
+        } else {
+            std::ofstream driftout;
+            auto ref_opts = stepper_options<double>(hamil, scheme, tol,
+                pi_beta);
+            timestepping::inplace::StepStats ref_stats;
+            if(validate_precision) {
+                driftout.open(fullfile(tag_filename(
+                    DRIFT_OUTFILEBASE, oftag_ss.str()), output_dir));
+                driftout << "t |tr(rho)-tr(rho_ref)|"
+                    << " |tr(rho^2)-tr(rho_ref^2)|" << std::endl;
             }
+            // Solve cycle-by-cycle. Add an extra iteration if a partial
+            // cycle is necessary
+            for(int cycle = 0; cycle < nfullcycles + has_partial_cycle;
+                ++cycle) {
+                if(!batchmode) {
+                    std::cout << "\rProgress: running cycle " << cycle + 1
+                        << "/" << nfullcycles + has_partial_cycle
+                        << std::flush;
+                }
+                if(adaptive_k) {
+                    // Resize once the excited populations have decayed.
+                    // Resetting again in solve_cycle() changes nothing
+                    hamil.initialize_cycle(rho);
+                    if(validate_precision) {
+                        hamil.initialize_cycle(rho_c);
+                    }
+                    int kmin, kmax;
+                    std::tie(kmin, kmax) = resized_momentum_range(rho,
+                        hamil.handler, adaptive_k_threshold,
+                        adaptive_k_margin, kdist_kmax);
+                    if(kmin != hamil.handler.kmin
+                        || kmax != hamil.handler.kmax) {
+                        DensMatHandler old_handler = hamil.handler;
+                        hamil.set_momentum_range(kmin, kmax);
+                        rho = hamil.handler.remap(rho, old_handler);
+                        if(validate_precision) {
+                            rho_c = hamil.handler.remap(rho_c, old_handler);
+                        }
+                        // The Lawson scheme's linear part is per element
+                        stepper_opts = stepper_options<real>(hamil, scheme,
+                            tol, pi_beta);
+                        ref_opts = stepper_options<double>(hamil, scheme,
+                            tol, pi_beta);
+                        ++k_resizes;
+                    }
+                }
+                double endtime = cycle_endtime(hamil, duration_by_decay,
+                    cycle);
+                // rho ends up as the final state, for the next cycle
+                endgt = solve_cycle(hamil, rho, cycle, endtime, stepper_opts,
+                    step_stats, &rho_out, &kdistout, kdist_kmax);
+                max_band_edge = std::max(max_band_edge,
+                    hamil.handler.band_edge_coherence(rho));
+                if(validate_precision) {
+                    // rho_c holds the double precision reference
+                    solve_cycle(hamil, rho_c, cycle, endtime, ref_opts,
+                        ref_stats);
+                    double trace_drift = std::abs(hamil.handler.totaltr(rho)
+                        - hamil.handler.totaltr(rho_c));
+                    double purity_drift = std::abs(hamil.handler.purity(rho)
+                        - hamil.handler.purity(rho_c));
+                    driftout << endgt/hamil.decay_rate << " " << trace_drift
+                        << " " << purity_drift << std::endl;
+                    max_trace_drift = std::max(max_trace_drift, trace_drift);
+                    max_purity_drift = std::max(max_purity_drift,
+                        purity_drift);
+                }
+            }
+        }
+        // Only the final state with Parareal
+        max_band_edge = std::max(max_band_edge,
+            hamil.handler.band_edge_coherence(rho));
+        rho_c.assign(rho.begin(), rho.end());
+        return endgt;
+    };
+    // A failed step stops the solution, keeping the output written before it
+    try {
+        if(single_precision) {
+            solution_endgt = solve(0.f);
+        } else {
+            solution_endgt = solve(0.);
+        }
+    } catch(const std::runtime_error& e) {
+        if(!batchmode) {
+            std::cout << std::endl;
         }
+        std::cout << "Solution failed: " << e.what() << std::endl;
+        return 1;
     }
     if(!batchmode) {
         std::cout << std::endl;
@@ -197,26 +323,291 @@ int main(int argc, char** argv) {
         std::chrono::duration<double> total_seconds =
             std::chrono::system_clock::now() - start;
             std::cout << "Simulation time: " << total_seconds.count() << " s"
-            << std::endl;
+            << " (" << hamil.threads() << " threads)" << std::endl;
         ///
+        std::cout << "Steps: " << step_stats.accepted << " accepted, "
+            << step_stats.rejected << " rejected" << std::endl
+            << "Derivative evaluations: " << step_stats.deriv_evals
+            << " (excluding output interpolation)" << std::endl
+            << "Time step range: [" << step_stats.min_dt << ", "
+            << step_stats.max_dt << "]" << std::endl;
+        if(scheme == timestepping::inplace::rosenbrock
+            || scheme == timestepping::inplace::auto_stiffness) {
+            std::cout << "Implicit steps: " << step_stats.implicit_steps
+                << ", stiffness switches: " << step_stats.switches
+                << std::endl;
+        }
+        if(validate_precision) {
+            std::cout << "Largest drift from double precision: "
+                << max_trace_drift << " in tr(rho), "
+                << max_purity_drift << " in tr(rho^2)" << std::endl;
+        }
+        if(hamil.handler.banded()) {
+            std::cout << "Largest coherence on the band edge: "
+                << max_band_edge << " of its bound from the populations"
+                << std::endl;
+        }
+        if(adaptive_k) {
+            std::cout << "Momentum state range: [" << hamil.handler.kmin
+                << ", " << hamil.handler.kmax << "] at the end, after "
+                << k_resizes << " resizes, limited to |k| <= " << kdist_kmax
+                << std::endl;
+        }
+        if(use_parareal) {
+            std::cout << "Parareal iterations: " << parareal_stats.iterations
+                << " over " << parareal_stats.windows << " windows"
+                << std::endl
+                << "Coarse steps: " << parareal_stats.coarse.accepted
+                << " accepted, " << parareal_stats.coarse.rejected
+                << " rejected" << std::endl;
+        }
     }
 
     // Write the final state to file
     double solution_endtime = solution_endgt / hamil.decay_rate;
     auto rhofinal = hamil.density_matrix(solution_endtime, rho_c);
     write_state_info(rho_out, solution_endtime, rhofinal, hamil.handler);
-    write_kdist(kdistout, solution_endtime, rhofinal, hamil.handler);
+    write_kdist(kdistout, solution_endtime, rhofinal, hamil.handler,
+        kdist_kmax);
     rho_out.close();
     kdistout.close();
 
     // Output just the final k distribution to a separate file for convenience
-    write_kdist(kdistfinalout, solution_endtime, rhofinal, hamil.handler);
+    write_kdist(kdistfinalout, solution_endtime, rhofinal, hamil.handler,
+        kdist_kmax);
     kdistfinalout.close();
 }
 
+double cycle_endtime(const HMotion& hamil, double duration_by_decay,
+    int cycle) {
+    return std::min(duration_by_decay,
+        (cycle+1)/hamil.detun_freq_per_decay)
+        - cycle/hamil.detun_freq_per_decay;
+}
+
+template<typename real>
+timestepping::inplace::AdaptiveOptions<std::complex<real>> stepper_options(
+    const HMotion& hamil, timestepping::inplace::adaptive_scheme scheme,
+    double tol, double pi_beta) {
+    timestepping::inplace::AdaptiveOptions<std::complex<real>> opts;
+    opts.scheme = scheme;
+    opts.tol = tol;
+    opts.pi_beta = pi_beta;
+    // Linear part integrated exactly by the Lawson scheme
+    if(scheme == timestepping::inplace::lawson_dormand_prince) {
+        opts.lin = hamil.recoil_diagonal<real>();
+    }
+    // The master equation is linear in rho_c, which saves the Rosenbrock
+    // schemes from differencing for their Jacobian
+    opts.linear = true;
+    return opts;
+}
+
+template<typename real>
+std::pair<int, int> resized_momentum_range(
+    const std::vector<std::complex<real>>& rho_c,
+    const DensMatHandler& handler, double threshold, int margin,
+    int max_k) {
+    std::vector<double> pk;
+    for(int k = handler.kmin; k <= handler.kmax; ++k) {
+        pk.push_back(std::real(handler.partialtr_n(rho_c, k)));
+    }
+    // Index into pk of the new low edge, which can be negative, and of the
+    // new high edge
+    int lo = 0, hi = pk.size() - 1;
+    if(pk.front() > threshold) {
+        lo = -margin;
+    } else {
+        double tail = 0;
+        while(lo < hi && tail + pk[lo] <= threshold) {
+            tail += pk[lo++];
+        }
+        // Only shrink by at least a margin, so that the derivative isn't
+        // reassembled every cycle
+        lo = lo >= 2*margin ? lo - margin : 0;
+    }
+    if(pk.back() > threshold) {
+        hi += margin;
+    } else {
+        int last = pk.size() - 1;
+        double tail = 0;
+        while(hi > lo && tail + pk[hi] <= threshold) {
+            tail += pk[hi--];
+        }
+        hi = last - hi >= 2*margin ? hi + margin : last;
+    }
+    return {std::max(handler.kmin + lo, -max_k),
+        std::min(handler.kmin + hi, max_k)};
+}
+
+template<typename real>
+double solve_cycle(HMotion& hamil, std::vector<std::complex<real>>& rho_c,
+    int cycle, double endtime,
+    timestepping::inplace::AdaptiveOptions<std::complex<real>> opts,
+    timestepping::inplace::StepStats& step_stats, std::ostream* rho_os,
+    std::ostream* kdist_os, int kdist_kmax) {
+    // Output at a fixed spacing within the cycle. Don't output the final
+    // state, since it'll be modified and included in the next
+    // iteration, or written after loop exit
+    std::vector<double> output_times;
+    if(rho_os || kdist_os) {
+        // Gamma*dt between output points
+        double output_gdt = 1. /
+            (OUTPUT_PTS_PER_CYCLE * hamil.detun_freq_per_decay);
+        for(unsigned i = 0; i*output_gdt < endtime; ++i) {
+            output_times.push_back(i*output_gdt);
+        }
+    }
+
+    auto write_output = [&](double t,
+        const std::vector<std::complex<real>>& rho_c_t) {
+        // Get the actual, global time
+        double gt = t + cycle/hamil.detun_freq_per_decay;
+        double time = gt / hamil.decay_rate;
+
+        auto rho = hamil.density_matrix(gt, rho_c_t);
+        if(rho_os) write_state_info(*rho_os, time, rho, hamil.handler);
+        if(kdist_os) {
+            write_kdist(*kdist_os, time, rho, hamil.handler, kdist_kmax);
+        }
+    };
+    opts.jacobian_diagonal = [&hamil](double gt,
+        std::vector<std::complex<real>>& diag) {
+        hamil.jacobian_diagonal(gt, diag);
+    };
+    // The stepper's loops over the elements run on the derivative's threads
+    opts.loop_parts = hamil.loop_parts();
+
+    // Prepare the density matrix for a new cycle
+    hamil.initialize_cycle(rho_c);
+    // Solve a full/partial system cycle in natural units with an
+    // adaptive RK method, writing the solution to file as it goes.
+    return timestepping::inplace::with_adaptive_stepper(
+        opts, [&](auto& stepper) {
+            double endgt = timestepping::inplace::odesolve(hamil, rho_c,
+                endtime, stepper, output_times, write_output);
+            step_stats += stepper.stats();
+            return endgt;
+        }) + cycle/hamil.detun_freq_per_decay;
+}
+
+template<typename real>
+double run_parareal(HMotion& hamil, std::vector<std::complex<real>>& rho_c,
+    double duration_by_decay,
+    const timestepping::inplace::AdaptiveOptions<std::complex<real>>&
+        fine_opts,
+    const PararealOptions& opts, std::ostream& rho_out,
+    std::ostream& kdistout, PararealStats& stats, bool batchmode) {
+    typedef std::vector<std::complex<real>> State;
+    int ncycles = static_cast<int>(
+        std::ceil(hamil.detun_freq_per_decay*duration_by_decay));
+    auto coarse_opts = fine_opts;
+    coarse_opts.tol = opts.coarse_tol;
+
+    // The cycles are spread over the derivative's threads, which are idle
+    // between the sequential coarse solves
+    ThreadPool& pool = *hamil.deriv_threads.pool;
+    unsigned window = opts.window ? opts.window : pool.size();
+    // The derivative operator caches its time dependent coefficients, so
+    // every thread needs its own. Copies compute their derivatives alone
+    std::vector<HMotion> thread_hamils(pool.size(), hamil);
+    std::mutex stats_mtx;
+    double endgt = 0;
+
+    // Windows of cycles are solved one after the other, so that only the
+    // output of one window is ever held in memory
+    for(int first = 0; first < ncycles; first += window) {
+        int n = std::min(static_cast<int>(window), ncycles - first);
+        ++stats.windows;
+        // u[i] is the state at the start of cycle first + i, and fine[i]
+        // the fine solution of cycle first + i from fine_start[i], the
+        // previous iterate of u[i]
+        std::vector<State> u(n + 1), fine(n), fine_start(n);
+        std::vector<double> fine_endgt(n);
+        std::vector<std::ostringstream> rho_bufs(n), kdist_bufs(n);
+        u[0] = rho_c;
+
+        // Initial prediction with the coarse propagator alone
+        for(int i = 0; i < n; ++i) {
+            u[i+1] = u[i];
+            solve_cycle(hamil, u[i+1], first + i,
+                cycle_endtime(hamil, duration_by_decay, first + i),
+                coarse_opts, stats.coarse);
+        }
+
+        // After iteration k, the first k + 1 boundary states are exact, so
+        // this always converges within n iterations
+        for(int k = 1; k <= n; ++k) {
+            if(!batchmode) {
+                std::cout << "\rProgress: running cycles " << first + 1
+                    << "-" << first + n << "/" << ncycles
+                    << ", iteration " << k << std::flush;
+            }
+            ++stats.iterations;
+            // Fine solves, in parallel, of the cycles that don't start from
+            // an exact state yet
+            std::atomic<int> next_cycle(k - 1);
+            pool.run([&](unsigned tid) {
+                timestepping::inplace::StepStats thread_stats;
+                for(int i = next_cycle++; i < n; i = next_cycle++) {
+                    fine_start[i] = u[i];
+                    fine[i] = u[i];
+                    rho_bufs[i].str("");
+                    kdist_bufs[i].str("");
+                    fine_endgt[i] = solve_cycle(thread_hamils[tid], fine[i],
+                        first + i,
+                        cycle_endtime(hamil, duration_by_decay, first + i),
+                        fine_opts, thread_stats, &rho_bufs[i],
+                        &kdist_bufs[i]);
+                }
+                std::lock_guard<std::mutex> lock(stats_mtx);
+                stats.fine += thread_stats;
+            });
+
+            // Sequential correction of the boundary states,
+            // u_new[i+1] = F(u_old[i]) + G(u_new[i]) - G(u_old[i]).
+            // A cycle is a linear map of the state, so the coarse terms are
+            // solved together as G(u_new[i] - u_old[i]). Since the tolerance
+            // is relative, their error then shrinks with the correction,
+            // rather than depending on how the adaptive steps fall
+            double change = 0;
+            for(int i = k - 1; i < n; ++i) {
+                State u_next = fine[i];
+                if(i > k - 1) {
+                    State correction(u[i].size());
+                    for(unsigned j = 0; j < u[i].size(); ++j) {
+                        correction[j] = u[i][j] - fine_start[i][j];
+                    }
+                    solve_cycle(hamil, correction, first + i,
+                        cycle_endtime(hamil, duration_by_decay, first + i),
+                        coarse_opts, stats.coarse);
+                    for(unsigned j = 0; j < u_next.size(); ++j) {
+                        u_next[j] += correction[j];
+                    }
+                }
+                for(unsigned j = 0; j < u_next.size(); ++j) {
+                    change = std::max(change,
+                        std::abs(std::complex<double>(u_next[j] - u[i+1][j])));
+                }
+                u[i+1] = std::move(u_next);
+            }
+            if(change <= opts.tol) break;
+        }
+
+        // The output of every cycle comes from its latest fine solve
+        for(int i = 0; i < n; ++i) {
+            rho_out << rho_bufs[i].str();
+            kdistout << kdist_bufs[i].str();
+        }
+        rho_c = u[n];
+        endgt = fine_endgt[n-1];
+    }
+    return endgt;
+}
+
 std::vector<std::complex<double>> thermal_state(double temp,
     const HMotion& hamil) {
-    std::vector<std::complex<double>> rho(hamil.handler.idxmap.size());
+    std::vector<std::complex<double>> rho(hamil.handler.size());
     double partition_fn = 0;
     for(int k = hamil.handler.kmin; k <= hamil.handler.kmax; ++k) {
         double boltz_weight = std::exp(-fundamental_constants::HBAR
@@ -234,7 +625,8 @@ std::vector<std::complex<double>> thermal_state(double temp,
 
 void print_system_info(const std::vector<std::complex<double>>& rho,
     const HMotion& hamil, double init_temp, double init_k, bool is_thermal,
-    double duration_by_decay, double tol) {
+    double duration_by_decay, double tol,
+    timestepping::inplace::adaptive_scheme scheme, double pi_beta) {
     // Parameters
     std::cout << "In units of decay rate when applicable:" << std::endl
         << "    Decay rate: " << hamil.decay_rate << std::endl
@@ -257,11 +649,25 @@ void print_system_info(const std::vector<std::complex<double>>& rho,
     }
     std::cout << "    Momentum state range: ["
         << hamil.handler.kmin << ", " << hamil.handler.kmax
-        << "]" << std::endl
-        << "    Duration: " << duration_by_decay << " ("
+        << "]" << std::endl;
+    if(hamil.handler.banded()) {
+        std::cout << "    Coherence bandwidth: " << hamil.handler.maxdk
+            << " (" << hamil.handler.size() << " stored elements)"
+            << std::endl;
+    }
+    std::cout << "    Duration: " << duration_by_decay << " ("
         << hamil.detun_freq_per_decay*duration_by_decay << " cycles)"
         << std::endl
+        << "    Stepper: " << timestepping::inplace::adaptive_scheme_name(scheme)
+        << std::endl
         << "    Stepper tolerance: " << tol << std::endl
+        << "    Step size control: ";
+    if(pi_beta == 0) {
+        std::cout << "proportional" << std::endl;
+    } else {
+        std::cout << "PI (beta = " << pi_beta << ")" << std::endl;
+    }
+    std::cout
         << std::endl;
 
     // Quality metrics
@@ -328,7 +734,7 @@ std::string evaluate_quality_metric(
     return okay_str;
 }
 
-void write_state_info(std::ofstream& outfile, double t,
+void write_state_info(std::ostream& outfile, double t,
     const std::vector<std::complex<double>>& rho, const DensMatHandler& handler) {
     outfile << t;
     for(unsigned n = 0; n < handler.nint; ++n) {
@@ -340,13 +746,18 @@ void write_state_info(std::ofstream& outfile, double t,
         << " " << calc_krms_unleaked(rho, handler);
     outfile << std::endl;
 }
-void write_kdist(std::ofstream& outfile, double t,
-    const std::vector<std::complex<double>>& rho, const DensMatHandler& handler) {
-    for(int k = handler.kmin; k <= handler.kmax; ++k) {
+void write_kdist(std::ostream& outfile, double t,
+    const std::vector<std::complex<double>>& rho, const DensMatHandler& handler,
+    int kmax) {
+    int kfirst = kmax < 0 ? handler.kmin : -kmax;
+    int klast = kmax < 0 ? handler.kmax : kmax;
+    for(int k = kfirst; k <= klast; ++k) {
+        bool tracked = k >= handler.kmin && k <= handler.kmax;
         outfile << t << " " << k
-            << " " << std::real(handler.partialtr_n(rho, k));
+            << " " << (tracked ? std::real(handler.partialtr_n(rho, k)) : 0);
         for(unsigned n = 0; n < handler.nint; ++n) {
-            outfile << " " << std::real(handler.ele(rho, n, k, n, k));
+            outfile << " "
+                << (tracked ? std::real(handler.ele(rho, n, k, n, k)) : 0);
         }
         outfile << std::endl;
     }
@@ -5,21 +5,44 @@
 #include <iomanip>
 #include <string>
 #include <fstream>
+#include <sstream>
 #include <complex>
 #include <vector>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
 #include <chrono>
+#include <stdexcept>
 #include "HMotion.hpp"
 #include "DensMatHandler.hpp"
 #include "lasercool/readcfg.hpp"
 #include "lasercool/iotag.hpp"
 #include "lasercool/timestepping.hpp"
 #include "lasercool/fundconst.hpp"
+#include "lasercool/threadpool.hpp"
+
+// Settings for solving the cycles in parallel with Parareal
+struct PararealOptions {
+    // Tolerance of the coarse propagator
+    double coarse_tol;
+    // Largest change of any cycle boundary element for convergence
+    double tol;
+    // Number of cycles solved together
+    unsigned window;
+};
+// Counts of the work done by a Parareal solve
+struct PararealStats {
+    unsigned windows = 0;
+    unsigned iterations = 0;
+    timestepping::inplace::StepStats fine, coarse;
+};
 
 // Generate a thermal state
 std::vector<std::complex<double>> thermal_state(double, const HMotion&);
 // Print out information about the system
 void print_system_info(const std::vector<std::complex<double>>&,
-    const HMotion&, double, double, bool, double, double);
+    const HMotion&, double, double, bool, double, double,
+    timestepping::inplace::adaptive_scheme, double);
 // Calculate the RMS k value of a state
 double calc_krms(const std::vector<std::complex<double>>&,
     const DensMatHandler&);
@@ -34,11 +57,45 @@ std::string evaluate_quality_metric(
     std::string okay_str="",
     std::string low_str="*",
     std::string very_low_str="**");
+// Final local time of a cycle, shorter for a final partial cycle
+double cycle_endtime(const HMotion&, double, int);
+// Options for the adaptive stepper at the precision of the density matrix
+template<typename real>
+timestepping::inplace::AdaptiveOptions<std::complex<real>> stepper_options(
+    const HMotion&, timestepping::inplace::adaptive_scheme, double, double);
+// Momentum range to track next, given the state at a cycle boundary, the
+// edge population threshold, the margin of states and the largest |k| to
+// track. Grows an edge whose state holds more than the threshold, up to the
+// largest |k|, and otherwise drops the states beyond the margin that
+// together hold less than it
+template<typename real>
+std::pair<int, int> resized_momentum_range(
+    const std::vector<std::complex<real>>&, const DensMatHandler&, double,
+    int, int);
+// Solve one cycle, starting from the final state of the previous cycle.
+// Optionally writes output at evenly spaced times to the given streams,
+// with the k-distribution over the grid given to write_kdist().
+// Returns the global final time
+template<typename real>
+double solve_cycle(HMotion&, std::vector<std::complex<real>>&, int, double,
+    timestepping::inplace::AdaptiveOptions<std::complex<real>>,
+    timestepping::inplace::StepStats&, std::ostream* rho_os=nullptr,
+    std::ostream* kdist_os=nullptr, int kdist_kmax=-1);
+// Solve all the cycles with Parareal, writing the same output as solving
+// them one by one. Returns the global final time
+template<typename real>
+double run_parareal(HMotion&, std::vector<std::complex<real>>&, double,
+    const timestepping::inplace::AdaptiveOptions<std::complex<real>>&,
+    const PararealOptions&, std::ostream&, std::ostream&, PararealStats&,
+    bool);
 // Write state info to a file given the density matrix at a fixed time
-void write_state_info(std::ofstream&, double,
-    const std::vector<std::complex<double>>&, const DensMatHandler&);
-// Write the k-distribution at a fixed time to a file in tall format
-void write_kdist(std::ofstream&, double,
+void write_state_info(std::ostream&, double,
     const std::vector<std::complex<double>>&, const DensMatHandler&);
+// Write the k-distribution at a fixed time to a file in tall format, for
+// |k| <= kmax with zeros for untracked states, or over the tracked range if
+// kmax is negative
+void write_kdist(std::ostream&, double,
+    const std::vector<std::complex<double>>&, const DensMatHandler&,
+    int kmax=-1);
 
 #endif
\ No newline at end of file
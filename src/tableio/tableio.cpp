@@ -0,0 +1,92 @@
+#include "lasercool/tableio.hpp"
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+
+TableWriter::TableWriter(unsigned long ncols, std::size_t buffer_bytes):
+    buffer(buffer_bytes), ncols(ncols), nvalues(0) {}
+
+void TableWriter::open(const std::string& fname,
+    std::ios_base::openmode mode) {
+    // A big buffer, and nothing ever flushes it early
+    out.rdbuf()->pubsetbuf(buffer.data(), buffer.size());
+    out.open(fname, mode);
+    if(!out) {
+        throw std::runtime_error("Could not open output file " + fname);
+    }
+}
+
+TextTableWriter::TextTableWriter(std::string fname, unsigned long ncols,
+    std::size_t buffer_bytes):TableWriter(ncols, buffer_bytes) {
+    open(fname, std::ios_base::out);
+}
+
+void TextTableWriter::write(const double* values, unsigned long n) {
+    for(unsigned long i = 0; i < n; ++i, ++nvalues) {
+        out << values[i];
+        out << ((ncols > 0 && (nvalues+1) % ncols == 0) ? '\n' : ' ');
+    }
+}
+
+const unsigned NpyTableWriter::header_bytes;
+
+NpyTableWriter::NpyTableWriter(std::string fname, unsigned long ncols,
+    std::size_t buffer_bytes):TableWriter(ncols, buffer_bytes) {
+    std::uint16_t one = 1;
+    unsigned char lowbyte;
+    std::memcpy(&lowbyte, &one, 1);
+    if(lowbyte != 1) {
+        throw std::runtime_error(".npy output assumes a little-endian host");
+    }
+    open(fname, std::ios_base::out | std::ios_base::binary);
+    write_header();
+}
+
+NpyTableWriter::~NpyTableWriter() {
+    if(out.is_open()) {
+        close();
+    }
+}
+
+void NpyTableWriter::write_header() {
+    std::ostringstream dict;
+    dict << "{'descr': '<f8', 'fortran_order': False, 'shape': (";
+    if(ncols > 0) {
+        dict << nvalues/ncols << ", " << ncols;
+    } else {
+        dict << nvalues << ",";
+    }
+    dict << "), }";
+    // Magic string, version 1.0, and little-endian header length
+    const unsigned prefix_bytes = 10;
+    std::string header = dict.str();
+    header.resize(header_bytes - prefix_bytes - 1, ' ');
+    header += '\n';
+    const unsigned header_len = header.size();
+    const char prefix[prefix_bytes] = {'\x93', 'N', 'U', 'M', 'P', 'Y', 1, 0,
+        static_cast<char>(header_len & 0xff),
+        static_cast<char>(header_len >> 8)};
+    out.write(prefix, prefix_bytes);
+    out.write(header.data(), header.size());
+}
+
+void NpyTableWriter::write(const double* values, unsigned long n) {
+    out.write(reinterpret_cast<const char*>(values), n*sizeof(double));
+    nvalues += n;
+}
+
+void NpyTableWriter::close() {
+    // Fill in the final shape
+    out.seekp(0);
+    write_header();
+    out.close();
+}
+
+std::unique_ptr<TableWriter> make_table_writer(std::string fname,
+    unsigned long ncols, bool binary) {
+    if(binary) {
+        return std::unique_ptr<TableWriter>(
+            new NpyTableWriter(fname, ncols));
+    }
+    return std::unique_ptr<TableWriter>(new TextTableWriter(fname, ncols));
+}
@@ -10,4 +10,22 @@ int main() {
     std::cout << "a:" << a << std::endl;
     std::cout << "b:" << b << std::endl;
     std::cout << "param1:" << param1 << std::endl;
+
+    // Parameter sweep specifications
+    auto sweep = read_sweep("test_sweep.cfg");
+    for(auto p: sweep) {
+        std::cout << p.first << ":";
+        for(auto v: p.second) {
+            std::cout << " " << v;
+        }
+        std::cout << std::endl;
+    }
+    // A missing sweep file must not read as an empty sweep
+    try {
+        read_sweep("missing_sweep.cfg");
+        std::cout << "Missing sweep file: no error" << std::endl;
+        return 1;
+    } catch(const std::runtime_error& e) {
+        std::cout << "Missing sweep file: " << e.what() << std::endl;
+    }
 }
\ No newline at end of file
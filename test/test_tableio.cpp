@@ -0,0 +1,26 @@
+#include "lasercool/tableio.hpp"
+#include <iostream>
+#include <vector>
+
+int main() {
+    std::vector<double> flat{0.5, 1.5, 2.5, 3.5};
+    for(bool binary: {false, true}) {
+        std::string ext = binary ? ".npy" : ".out";
+        // Two-column table, written row by row and as a block of rows
+        auto table = make_table_writer("table" + ext, 2, binary);
+        table->write_row({0, 1});
+        table->write_row({1, -2.25});
+        table->write(flat.data(), flat.size());
+        table->close();
+        // Flat list
+        auto list = make_table_writer("list" + ext, 0, binary);
+        list->write(flat.data(), flat.size());
+        list->close();
+        std::cout << (binary ? "npy" : "text") << ": wrote "
+            << table->size() << " table values and "
+            << list->size() << " list values" << std::endl;
+    }
+    // Expected contents, as numpy.load("table.npy"):
+    // [[0, 1], [1, -2.25], [0.5, 1.5], [2.5, 3.5]], and numpy.load("list.npy"):
+    // [0.5, 1.5, 2.5, 3.5]
+}
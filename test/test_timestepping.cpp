@@ -1,5 +1,7 @@
 #include "lasercool/timestepping.hpp"
+#include <algorithm>
 #include <fstream>
+#include <iostream>
 #include <string>
 #include <sstream>
 #include <vector>
@@ -50,6 +52,40 @@ void write_ode(DerivFn deriv, const std::vector<dtype>& y0, double t_final,
     }
 }
 
+template<typename dtype, typename stringer,
+    typename DerivFn, typename Stepper>
+std::vector<std::pair<double, std::vector<dtype>>> write_ode_inplace(DerivFn deriv, const std::vector<dtype>& y0,
+    double t_final, Stepper step, std::string fname, stringer str) {
+
+    std::ofstream outfile(fname);
+
+    auto odeout = timestepping::inplace::odesolve(deriv, y0, t_final, step);
+    for(auto point: odeout) {
+        outfile << point.first;
+        for(auto cmp: point.second) {
+            outfile << " " << str(cmp);
+        }
+        outfile << std::endl;
+    }
+    return odeout;
+}
+
+// Largest deviation of a solution from the exact one
+template<typename dtype, typename ExactFn>
+double max_error(
+    const std::vector<std::pair<double, std::vector<dtype>>>& odeout,
+    ExactFn exact) {
+    double err = 0;
+    for(const auto& point: odeout) {
+        auto y = exact(point.first);
+        for(unsigned i = 0; i < y.size(); ++i) {
+            err = std::max(err,
+                static_cast<double>(std::abs(point.second[i] - y[i])));
+        }
+    }
+    return err;
+}
+
 int main() {
     // auto step = timestepping::RK2(1e-3);
     // auto step = timestepping::RK4(1e-3);
@@ -77,4 +113,184 @@ int main() {
         },
         std::vector<std::complex<float>>{1},
             t_final, step, "cexpf.out", str_complex<float>);
+
+    // In-place steppers, which should reproduce cexp.out and cexpf.out
+    write_ode_inplace([f](double, const std::vector<std::complex<double>>& y,
+        std::vector<std::complex<double>>& dy) {
+            dy = deriv_exp(y, 2.*M_PI*1i*f);
+        },
+        std::vector<std::complex<double>>{1}, t_final,
+        timestepping::inplace::AdaptiveRK<std::complex<double>>(1e-3, 1e-1),
+        "cexp_inplace.out", str_complex<double>);
+    write_ode_inplace([f](double, const std::vector<std::complex<float>>& y,
+        std::vector<std::complex<float>>& dy) {
+            dy = deriv_exp(y, static_cast<std::complex<float>>(2.*M_PI*1i*f));
+        },
+        std::vector<std::complex<float>>{1}, t_final,
+        timestepping::inplace::AdaptiveRK<std::complex<float>>(1e-3, 1e-1),
+        "cexpf_inplace.out", str_complex<float>);
+    // Embedded pairs
+    write_ode_inplace([f](double, const std::vector<std::complex<double>>& y,
+        std::vector<std::complex<double>>& dy) {
+            dy = deriv_exp(y, 2.*M_PI*1i*f);
+        },
+        std::vector<std::complex<double>>{1}, t_final,
+        timestepping::inplace::DormandPrince<std::complex<double>>(1e-3, 1e-1),
+        "cexp_dopri.out", str_complex<double>);
+    write_ode_inplace([f](double, const std::vector<std::complex<double>>& y,
+        std::vector<std::complex<double>>& dy) {
+            dy = deriv_exp(y, 2.*M_PI*1i*f);
+        },
+        std::vector<std::complex<double>>{1}, t_final,
+        timestepping::inplace::CashKarp<std::complex<double>>(1e-3, 1e-1),
+        "cexp_cashkarp.out", str_complex<double>);
+    // Fast rotation on top of the complex exponential, which the Lawson
+    // scheme integrates exactly
+    double w = 200;
+    auto deriv_fastrot = [f, w](double,
+        const std::vector<std::complex<double>>& y,
+        std::vector<std::complex<double>>& dy) {
+            dy = deriv_exp(y, 1i*(2.*M_PI*f + w));
+        };
+    write_ode_inplace(deriv_fastrot, std::vector<std::complex<double>>{1},
+        t_final,
+        timestepping::inplace::DormandPrince<std::complex<double>>(1e-3, 1e-1),
+        "fastrot_dopri.out", str_complex<double>);
+    auto fastrot_lawson = write_ode_inplace(deriv_fastrot,
+        std::vector<std::complex<double>>{1}, t_final,
+        timestepping::inplace::LawsonDormandPrince<std::complex<double>>(
+            {1i*w}, 1e-3, 1e-1),
+        "fastrot_lawson.out", str_complex<double>);
+    // A local tolerance of 1e-3 over the ~70 steps it takes keeps the global
+    // error to a few percent, while Dormand-Prince alone drifts by ~50%
+    double fastrot_err = max_error(fastrot_lawson, [f, w](double t) {
+            return std::vector<std::complex<double>>{
+                std::exp(1i*(2.*M_PI*f + w)*t)};
+        });
+    std::cout << "Lawson fast rotation error: " << fastrot_err << std::endl;
+    if(!(fastrot_err < 0.05)) {
+        return 1;
+    }
+    // Stiff Prothero-Robinson problem, y' = lambda*(y - cos(t)) - sin(t),
+    // with solution cos(t), which the implicit schemes can take large steps
+    // through
+    double lambda = -1e4;
+    auto deriv_stiff = [lambda](double t, const std::vector<double>& y,
+        std::vector<double>& dy) {
+            dy = {lambda*(y[0] - std::cos(t)) - std::sin(t)};
+        };
+    write_ode_inplace(deriv_stiff, std::vector<double>{1}, t_final,
+        timestepping::inplace::DormandPrince<double>(1e-4, 1e-3),
+        "stiff_dopri.out", str_real<double>);
+    write_ode_inplace(deriv_stiff, std::vector<double>{1}, t_final,
+        timestepping::inplace::Rosenbrock2<double>(1e-4, 1e-3),
+        "stiff_rosenbrock.out", str_real<double>);
+    write_ode_inplace(deriv_stiff, std::vector<double>{1}, t_final,
+        timestepping::inplace::AutoStiffRK<double>(1e-4, 1e-3),
+        "stiff_auto.out", str_real<double>);
+
+    // Batch of complex exponentials with different frequencies, each lane
+    // stepping on its own. The last lane matches cexp_dopri.out
+    std::ofstream batchout("cexp_batch.out");
+    const unsigned nlanes = 4;
+    std::vector<double> t_lanes(nlanes, 0), t_final_lanes(nlanes, t_final);
+    std::vector<std::complex<double>> y_lanes(nlanes, 1);
+    timestepping::inplace::BatchDormandPrince<std::complex<double>>
+        batch_stepper(nlanes, 1e-3, 1e-1);
+    auto deriv_batch = [f, nlanes](const std::vector<double>&,
+        const std::vector<std::complex<double>>& y,
+        std::vector<std::complex<double>>& dy) {
+            dy.resize(y.size());
+            for(unsigned l = 0; l < nlanes; ++l) {
+                dy[l] = 2.*M_PI*1i*(f*(l + 1)/nlanes)*y[l];
+            }
+        };
+    while(batch_stepper.step(t_lanes, y_lanes, t_final_lanes, deriv_batch)) {}
+    for(unsigned l = 0; l < nlanes; ++l) {
+        batchout << t_lanes[l] << " " << str_complex(y_lanes[l]) << std::endl;
+    }
+
+    // Loops split into parts, run here in reverse order, must give the same
+    // solution as whole loops, for every scheme that splits them
+    const unsigned nparts = 3;
+    timestepping::inplace::LoopParts reversed_parts;
+    reversed_parts.parts = nparts;
+    reversed_parts.run = [nparts](unsigned n,
+        const std::function<void(unsigned, unsigned, unsigned)>& body) {
+            for(unsigned part = nparts; part-- > 0;) {
+                body(part, part*n/nparts, (part + 1)*n/nparts);
+            }
+        };
+    auto deriv_freqs = [f](double, const std::vector<std::complex<double>>& y,
+        std::vector<std::complex<double>>& dy) {
+            dy.resize(y.size());
+            for(unsigned i = 0; i < y.size(); ++i) {
+                dy[i] = 2.*M_PI*1i*(f*(i + 1))*y[i];
+            }
+        };
+    std::vector<std::complex<double>> y_freqs(7, 1);
+    for(auto scheme: {timestepping::inplace::step_doubling,
+        timestepping::inplace::dormand_prince,
+        timestepping::inplace::lawson_dormand_prince}) {
+        timestepping::inplace::AdaptiveOptions<std::complex<double>> opts;
+        opts.scheme = scheme;
+        opts.tol = 1e-3;
+        opts.lin.assign(y_freqs.size(), 1i);
+        std::vector<std::complex<double>> y_whole = y_freqs,
+            y_parts = y_freqs;
+        timestepping::inplace::with_adaptive_stepper(opts, [&](auto& stepper) {
+            return timestepping::inplace::odesolve(deriv_freqs, y_whole,
+                t_final, stepper, std::vector<double>{},
+                [](double, const std::vector<std::complex<double>>&) {});
+        });
+        opts.loop_parts = reversed_parts;
+        timestepping::inplace::with_adaptive_stepper(opts, [&](auto& stepper) {
+            return timestepping::inplace::odesolve(deriv_freqs, y_parts,
+                t_final, stepper, std::vector<double>{},
+                [](double, const std::vector<std::complex<double>>&) {});
+        });
+        if(y_whole != y_parts) {
+            std::cout << "Loop parts: "
+                << timestepping::inplace::adaptive_scheme_name(scheme)
+                << " differs" << std::endl;
+            return 1;
+        }
+    }
+
+    // Streaming solve with dense output at a fixed spacing
+    std::ofstream denseout("cexp_dense.out");
+    std::vector<double> t_obs;
+    for(unsigned i = 0; i <= 1000; ++i) {
+        t_obs.push_back(i*t_final/1000);
+    }
+    std::vector<std::complex<double>> y{1};
+    timestepping::inplace::odesolve(
+        [f](double, const std::vector<std::complex<double>>& y,
+            std::vector<std::complex<double>>& dy) {
+            dy = deriv_exp(y, 2.*M_PI*1i*f);
+        },
+        y, t_final,
+        timestepping::inplace::AdaptiveRK<std::complex<double>>(1e-3, 1e-1),
+        t_obs, [&denseout](double t, const std::vector<std::complex<double>>& y) {
+            denseout << t << " " << str_complex(y[0]) << std::endl;
+        });
+
+    // A step that fails must stop the streaming solve rather than quietly
+    // truncate it
+    std::vector<double> y_fail{1};
+    try {
+        timestepping::inplace::odesolve(
+            [](double t, const std::vector<double>& y,
+                std::vector<double>& dy) {
+                if(t > 1) throw std::runtime_error("Derivative failed");
+                dy = {y[0]};
+            },
+            y_fail, t_final,
+            timestepping::inplace::DormandPrince<double>(1e-3, 1e-1),
+            std::vector<double>{}, [](double, const std::vector<double>&) {});
+        std::cout << "Failed step: no error" << std::endl;
+        return 1;
+    } catch(const std::runtime_error& e) {
+        std::cout << "Failed step: " << e.what() << std::endl;
+    }
 }